@@ -0,0 +1,353 @@
+#include "aio.h"
+#include "common.h"
+
+#include <cerrno>
+#include <cstring>
+#include <cinttypes>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+uint64_t AioEngine::Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+template<typename T>
+static inline void AtomicMax(std::atomic<T> &a, T val)
+{
+	T cur = a.load(std::memory_order_relaxed);
+	while (cur < val && !a.compare_exchange_weak(cur, val,
+				std::memory_order_relaxed));
+}
+
+void AioEngine::OnSubmit(AioRequest *req)
+{
+	req->submitTime = Now();
+	stats.submitted.fetch_add(1, std::memory_order_relaxed);
+	uint32_t depth = stats.depth.fetch_add(1, std::memory_order_relaxed) + 1;
+	AtomicMax(stats.maxDepth, depth);
+}
+
+void AioEngine::OnComplete(AioRequest *req, ssize_t res)
+{
+	uint64_t lat = Now() - req->submitTime;
+	stats.latencyNs.fetch_add(lat, std::memory_order_relaxed);
+	AtomicMax(stats.maxLatencyNs, lat);
+	if (res < 0)
+		stats.errors.fetch_add(1, std::memory_order_relaxed);
+	else
+		stats.bytes.fetch_add(res, std::memory_order_relaxed);
+	stats.completed.fetch_add(1, std::memory_order_relaxed);
+
+	req->done(req, res); /* req may be reused after that */
+
+	if (stats.depth.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		std::lock_guard<std::mutex> lock(drainMtx);
+		drainCv.notify_all();
+	}
+}
+
+void AioEngine::Drain()
+{
+	std::unique_lock<std::mutex> lock(drainMtx);
+	drainCv.wait(lock, [this] { return stats.depth.load() == 0; });
+}
+
+void AioStats::Dump(std::ostream &os)
+{
+	uint64_t nc = completed.load();
+	uint64_t nb = batches.load();
+	double elapsed = (AioEngine::Now() - startTime) / 1e9;
+	os << putf("aio: %" PRIu64 " reqs, %" PRIu64 " errors, %" PRIu64 " batches (%.2f reqs/batch)\n",
+			nc, errors.load(), nb, nb ? (double) submitted.load() / nb : 0.);
+	os << putf("aio: depth max %" PRIu32 ", latency avg %.1fus max %.1fus\n",
+			maxDepth.load(), nc ? latencyNs.load() / 1e3 / nc : 0.,
+			maxLatencyNs.load() / 1e3);
+	os << putf("aio: %" PRIu64 " bytes, %.2f MB/s, %.0f IOPS\n",
+			bytes.load(), bytes.load() / 1e6 / elapsed, nc / elapsed);
+}
+
+/****************************** Thread pool ***********************************/
+
+struct AioThreadPool : public AioEngine {
+	static constexpr unsigned N_THREADS = 4;
+
+	AioThreadPool()
+	{
+		for (unsigned i = 0; i < N_THREADS; ++i)
+			workers.emplace_back(&AioThreadPool::Worker, this);
+	}
+	~AioThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		for (auto &t : workers)
+			t.join();
+	}
+	char const *Name() { return "threads"; }
+
+	void Submit(AioRequest **reqs, size_t n)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			for (size_t i = 0; i < n; ++i) {
+				OnSubmit(reqs[i]);
+				queue.push_back(reqs[i]);
+			}
+		}
+		stats.batches.fetch_add(1, std::memory_order_relaxed);
+		if (n == 1)
+			cv.notify_one();
+		else
+			cv.notify_all();
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<AioRequest*> queue;
+	std::vector<std::thread> workers;
+	bool stop = false;
+
+	void Worker()
+	{
+		while (1) {
+			AioRequest *req;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv.wait(lock, [this] { return stop || !queue.empty(); });
+				if (queue.empty())
+					return;
+				req = queue.front();
+				queue.pop_front();
+			}
+			ssize_t rc;
+			if (req->op == AioRequest::OP_READ)
+				rc = pread(req->fd, req->buf, req->len, req->off);
+			else
+				rc = pwrite(req->fd, req->buf, req->len, req->off);
+			OnComplete(req, rc < 0 ? -errno : rc);
+		}
+	}
+};
+
+/******************************** io_uring ************************************/
+
+struct AioUring : public AioEngine {
+	static constexpr unsigned N_ENTRIES = 64;
+
+	int Setup()
+	{
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		int rc = syscall(__NR_io_uring_setup, N_ENTRIES, &p);
+		if (rc < 0)
+			return -errno;
+		ring_fd = rc;
+
+		sqRingSz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+		cqRingSz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single)
+			sqRingSz = cqRingSz = std::max(sqRingSz, cqRingSz);
+
+		sqRing = Map(sqRingSz, IORING_OFF_SQ_RING);
+		if (!sqRing)
+			return -errno;
+		cqRing = single ? sqRing : Map(cqRingSz, IORING_OFF_CQ_RING);
+		if (!cqRing)
+			return -errno;
+		sqesSz = p.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = (struct io_uring_sqe*) Map(sqesSz, IORING_OFF_SQES);
+		if (!sqes)
+			return -errno;
+
+		sqHead = (uint32_t*) (sqRing + p.sq_off.head);
+		sqTail = (uint32_t*) (sqRing + p.sq_off.tail);
+		sqMask = *(uint32_t*) (sqRing + p.sq_off.ring_mask);
+		sqArray = (uint32_t*) (sqRing + p.sq_off.array);
+		sqEntries = p.sq_entries;
+		cqHead = (uint32_t*) (cqRing + p.cq_off.head);
+		cqTail = (uint32_t*) (cqRing + p.cq_off.tail);
+		cqMask = *(uint32_t*) (cqRing + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*) (cqRing + p.cq_off.cqes);
+
+		reaper = std::thread(&AioUring::Reaper, this);
+		return 0;
+	}
+	~AioUring()
+	{
+		if (reaper.joinable()) {
+			std::lock_guard<std::mutex> lock(sqMtx);
+			PushSqe(IORING_OP_NOP, NULL);
+			Enter(1, 0, 0);
+		}
+		if (reaper.joinable())
+			reaper.join();
+		if (sqes)
+			munmap(sqes, sqesSz);
+		if (cqRing && cqRing != sqRing)
+			munmap(cqRing, cqRingSz);
+		if (sqRing)
+			munmap(sqRing, sqRingSz);
+		if (ring_fd >= 0)
+			close(ring_fd);
+	}
+	char const *Name() { return "io_uring"; }
+
+	void Submit(AioRequest **reqs, size_t n)
+	{
+		std::vector<std::pair<AioRequest*, int>> failed;
+		{
+			std::lock_guard<std::mutex> lock(sqMtx);
+			for (size_t i = 0; i < n; ++i) {
+				AioRequest *req = reqs[i];
+				OnSubmit(req);
+				req->iov.iov_base = req->buf;
+				req->iov.iov_len = req->len;
+				uint8_t opcode = (req->op == AioRequest::OP_READ) ?
+					IORING_OP_READV : IORING_OP_WRITEV;
+				while (!PushSqe(opcode, req)) /* sq full */
+					Flush(failed);
+			}
+			Flush(failed);
+		}
+		for (auto &f : failed)
+			OnComplete(f.first, f.second);
+		stats.batches.fetch_add(1, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr unsigned MAX_BUSY = 100; /* ms of retries */
+	int ring_fd = -1;
+	char *sqRing = NULL, *cqRing = NULL;
+	size_t sqRingSz = 0, cqRingSz = 0, sqesSz = 0;
+	struct io_uring_sqe *sqes = NULL;
+	struct io_uring_cqe *cqes = NULL;
+	uint32_t *sqHead, *sqTail, *sqArray, sqMask, sqEntries;
+	uint32_t *cqHead, *cqTail, cqMask;
+	std::mutex sqMtx;
+	std::thread reaper;
+
+	char *Map(size_t sz, off_t offs)
+	{
+		void *ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd, offs);
+		return ptr == MAP_FAILED ? NULL : (char*) ptr;
+	}
+
+	int Enter(unsigned submit, unsigned wait, unsigned flags)
+	{
+		int rc;
+		do {
+			rc = syscall(__NR_io_uring_enter, ring_fd, submit, wait,
+					flags, NULL, 0);
+		} while (rc < 0 && errno == EINTR);
+		return rc;
+	}
+
+	/*
+	 * Hand queued SQEs to the kernel, it leaves the ones it didn't take
+	 * in the ring. Busy ring (CQ overflow) is retried once reaper made
+	 * room; on other errors the SQEs are taken back and their requests
+	 * go to failed, to complete with the error.
+	 */
+	void Flush(std::vector<std::pair<AioRequest*, int>> &failed)
+	{
+		unsigned busy = 0;
+		while (1) {
+			uint32_t head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			uint32_t tail = *sqTail;
+			if (head == tail)
+				return;
+			int rc = Enter(tail - head, 0, 0);
+			if (rc > 0)
+				continue;
+			int err = rc < 0 ? errno : EAGAIN;
+			if ((err == EBUSY || err == EAGAIN) && busy++ < MAX_BUSY) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			for (uint32_t i = head; i != tail; ++i) {
+				uint32_t idx = sqArray[i & sqMask];
+				AioRequest *req = (AioRequest*) sqes[idx].user_data;
+				if (req)
+					failed.emplace_back(req, -err);
+			}
+			__atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+
+	bool PushSqe(uint8_t opcode, AioRequest *req)
+	{
+		uint32_t tail = *sqTail;
+		uint32_t head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		if (tail - head == sqEntries)
+			return false;
+		uint32_t idx = tail & sqMask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		if (req) {
+			sqe->fd = req->fd;
+			sqe->addr = (uint64_t) &req->iov;
+			sqe->len = 1;
+			sqe->off = req->off;
+		}
+		sqe->user_data = (uint64_t) req;
+		sqArray[idx] = idx;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	void Reaper()
+	{
+		while (1) {
+			uint32_t head = *cqHead;
+			uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			if (head == tail) {
+				/* back off rather than spin if the ring fails */
+				if (Enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+					std::this_thread::sleep_for(
+						std::chrono::milliseconds(1));
+				continue;
+			}
+			for (; head != tail; ++head) {
+				struct io_uring_cqe *cqe = &cqes[head & cqMask];
+				AioRequest *req = (AioRequest*) cqe->user_data;
+				int res = cqe->res;
+				__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+				if (!req)
+					return;
+				OnComplete(req, res);
+			}
+		}
+	}
+};
+
+AioEngine *AioEngine::Create(Backend backend)
+{
+	if (backend != BACKEND_THREADS) {
+		AioUring *uring = new AioUring;
+		if (uring->Setup() == 0)
+			return uring;
+		delete uring;
+		if (backend == BACKEND_URING)
+			return NULL;
+	}
+	return new AioThreadPool;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Host-side asynchronous block I/O engine */
+
+struct AioRequest {
+	enum Op : uint8_t {
+		OP_READ,
+		OP_WRITE,
+	};
+	int fd;
+	Op op;
+	void *buf;
+	size_t len;
+	off_t off;
+	/* engine thread or Submit() if host refused it, res is bytes or -errno */
+	void (*done)(AioRequest *req, ssize_t res);
+	void *ctx;
+
+	/* engine private */
+	uint64_t submitTime;
+	struct iovec iov;
+};
+
+struct AioStats {
+	std::atomic<uint64_t> submitted { 0 };
+	std::atomic<uint64_t> completed { 0 };
+	std::atomic<uint64_t> batches   { 0 };
+	std::atomic<uint64_t> errors    { 0 };
+	std::atomic<uint64_t> bytes     { 0 };
+	std::atomic<uint64_t> latencyNs { 0 };
+	std::atomic<uint64_t> maxLatencyNs { 0 };
+	std::atomic<uint32_t> depth     { 0 };
+	std::atomic<uint32_t> maxDepth  { 0 };
+	uint64_t startTime = 0;
+
+	void Dump(std::ostream &os);
+};
+
+struct AioEngine {
+	enum Backend : uint8_t {
+		BACKEND_AUTO,
+		BACKEND_URING,
+		BACKEND_THREADS,
+	};
+	AioStats stats;
+
+	/* whole batch is pushed to the host in one go */
+	virtual void Submit(AioRequest **reqs, size_t n) = 0;
+	virtual char const *Name() = 0;
+	virtual ~AioEngine() { }
+	/* wait for all submitted requests */
+	void Drain();
+
+	/* NULL if requested backend is unavailable */
+	static AioEngine *Create(Backend backend = BACKEND_AUTO);
+	static uint64_t Now();
+protected:
+	AioEngine() { stats.startTime = Now(); }
+	void OnSubmit(AioRequest *req);
+	void OnComplete(AioRequest *req, ssize_t res);
+private:
+	std::mutex drainMtx;
+	std::condition_variable drainCv;
+};
@@ -0,0 +1,202 @@
+#include "blkdev.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int BlkDev::Open(char const *path)
+{
+	int rc;
+	struct stat st;
+
+	if ((rc = open(path, O_RDWR)) < 0)
+		return rc;
+	fd = rc;
+	if ((rc = fstat(fd, &st)) < 0) {
+		Close();
+		return rc;
+	}
+	size_t n = st.st_size / BLK_SZ;
+	nblk = n > 0xffff ? 0xffff : n;
+	return 0;
+}
+
+int BlkDev::Close()
+{
+	int rc = 0;
+	if (fd != -1) {
+		aio->Drain();
+		rc = close(fd);
+		fd = -1;
+	}
+	return rc;
+}
+
+void BlkDev::Complete(AioRequest *req, ssize_t res)
+{
+	Slot *slot = (Slot*) req->ctx;
+	BlkDev *dev = slot->dev;
+	word_t *desc = (word_t*) (slot->mem + slot->desc);
+	word_t status = *desc | DESC_DONE;
+
+	if (res != (ssize_t) req->len) {
+		status |= DESC_ERR;
+		dev->error.store(true, std::memory_order_relaxed);
+	}
+	__atomic_store_n(desc, status, __ATOMIC_RELEASE);
+	dev->done.fetch_add(1, std::memory_order_release);
+}
+
+bool BlkDev::Prepare(Emu &emu, Slot &slot, word_t desc)
+{
+	auto &core = emu.coreMem;
+	if (!Emu::IsPtrAligned<word_t>(desc) || !core.PAExist(desc + DESC_SZ - 1))
+		return false;
+	word_t *d = (word_t*) (core.mem + desc);
+	word_t cmd = d[0] & DESC_CMD, blk = d[1], buf = d[2], cnt = d[3];
+
+	if (cmd != DESC_READ && cmd != DESC_WRITE)
+		return false;
+	if (cnt == 0 || (size_t) buf + cnt > core.sz)
+		return false;
+	if ((size_t) blk * BLK_SZ + cnt > (size_t) nblk * BLK_SZ)
+		return false;
+
+	d[0] &= DESC_CMD;
+	core.Dirty(desc, DESC_SZ); /* status is written on completion */
+	if (cmd == DESC_READ) { /* DMA may overwrite code */
+		core.Dirty(buf, cnt);
+		emu.TrCacheInvalidate(buf, cnt);
+	}
+	slot.dev = this;
+	slot.desc = desc;
+	slot.mem = core.mem;
+	AioRequest &req = slot.req;
+	req.fd = fd;
+	req.op = (cmd == DESC_READ) ? AioRequest::OP_READ : AioRequest::OP_WRITE;
+	req.buf = core.mem + buf;
+	req.len = cnt;
+	req.off = (off_t) blk * BLK_SZ;
+	req.done = &Complete;
+	req.ctx = &slot;
+	return true;
+}
+
+void BlkDev::Kick(Emu &emu)
+{
+	AioRequest *batch[MAX_RING];
+	size_t n = 0;
+
+	if (!size || (word_t) (head - done.load()) > size) {
+		error.store(true);
+		head = tail;
+		return;
+	}
+	for (; tail != head; ++tail) {
+		word_t desc = ring + (tail % size) * DESC_SZ;
+		Slot &slot = slots[tail % size];
+		if (fd == -1 || !Prepare(emu, slot, desc)) {
+			if (emu.coreMem.PAExist(desc + 1)) {
+				*(word_t*) (emu.coreMem.mem + desc) |= DESC_DONE | DESC_ERR;
+				emu.coreMem.Dirty(desc, sizeof(word_t));
+			}
+			error.store(true);
+			done.fetch_add(1);
+			continue;
+		}
+		batch[n++] = &slot.req;
+	}
+	if (n)
+		aio->Submit(batch, n);
+}
+
+void BlkDev::Load(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)
+{
+	word_t reg;
+	switch (ptr / 2) {
+		case CSR:
+			reg = (done.load(std::memory_order_acquire) == tail) ?
+				CSR_READY : 0;
+			if (error.load())
+				reg |= CSR_ERROR;
+			break;
+		case RING:
+			reg = ring;
+			break;
+		case SIZE:
+			reg = size;
+			break;
+		case HEAD:
+			reg = head;
+			break;
+		case DONE:
+			reg = done.load(std::memory_order_acquire);
+			break;
+		case NBLK:
+			reg = nblk;
+			break;
+		default:
+			emu.RaiseTrap(Emu::TRAP_MME);
+			return;
+	}
+	memcpy(buf, (byte_t*) &reg + ptr % 2, sz);
+}
+
+void BlkDev::Reset(Emu &emu)
+{
+	Sync(emu);
+	error.store(false);
+	ring = size = head = tail = 0;
+	done.store(0);
+}
+
+void BlkDev::Store(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)
+{
+	word_t val = 0;
+	/* byte store changes its half only, the other is kept as Load() reads */
+	if (sz < sizeof(word_t)) {
+		switch (ptr / 2) {
+			case RING:
+				val = ring;
+				break;
+			case SIZE:
+				val = size;
+				break;
+			case HEAD:
+				val = head;
+				break;
+		}
+	}
+	memcpy((byte_t*) &val + ptr % 2, buf, sz);
+	bool idle = (done.load() == tail);
+
+	switch (ptr / 2) {
+		case CSR:
+			if ((val & CSR_RESET) && idle) {
+				error.store(false);
+				head = tail = 0;
+				done.store(0);
+			}
+			break;
+		case RING:
+			if (idle)
+				ring = val;
+			break;
+		case SIZE:
+			if (idle)
+				size = (val > MAX_RING) ? MAX_RING : val;
+			break;
+		case HEAD:
+			head = val;
+			Kick(emu);
+			break;
+		case DONE:
+		case NBLK:
+			break;
+		default:
+			emu.RaiseTrap(Emu::TRAP_MME);
+			return;
+	}
+}
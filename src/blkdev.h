@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include "emu.h"
+#include "aio.h"
+
+/*
+ * Queued block storage device.
+ * Guest places 4-word descriptors in a ring in core memory and rings HEAD,
+ * requests are passed to AioEngine as one batch and complete asynchronously:
+ * data is DMA'd to/from core, descriptor status is written back and DONE
+ * counter advances. Guest polls DONE or descriptor status.
+ */
+struct BlkDev : public Emu::DevBase {
+	enum RegId : word_t {
+		CSR  = 0,	/* r: ready/error, w: CSR_RESET */
+		RING = 1,	/* ring base address in core */
+		SIZE = 2,	/* ring size, descriptors */
+		HEAD = 3,	/* producer index, write submits */
+		DONE = 4,	/* completed descriptors counter, r/o */
+		NBLK = 5,	/* device size in blocks, r/o */
+		MAX_REG,
+	};
+	enum CSRBits : word_t {
+		CSR_RESET = 0x0001,
+		CSR_READY = 0x0080,	/* no requests in flight */
+		CSR_ERROR = 0x8000,	/* sticky, any request failed */
+	};
+	/* Descriptor: cmd/status, blkno, bufaddr, byte count */
+	enum DescCmd : word_t {
+		DESC_READ  = 1,
+		DESC_WRITE = 2,
+		DESC_CMD   = 0x000f,
+		DESC_DONE  = 0x0080,
+		DESC_ERR   = 0x8000,
+	};
+	static constexpr word_t DESC_SZ = 4 * sizeof(word_t);
+	static constexpr word_t MAX_RING = 64;
+	static constexpr size_t BLK_SZ = 512;
+
+	static constexpr word_t BASE_ADDR = 0177400;
+	static constexpr word_t ADDR_LEN = MAX_REG * sizeof(word_t);
+
+	BlkDev(AioEngine *engine) : aio(engine) { }
+	~BlkDev() { Close(); }
+
+	void getInfo(Emu::DevInfo &info)
+	{
+		info.ptr = BASE_ADDR;
+		info.len = ADDR_LEN;
+		info.dev = this;
+	}
+
+	int Open(char const *path);
+	int Close();
+
+	void Load(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz);
+	void Store(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz);
+	void Sync(Emu &emu) { if (fd != -1) aio->Drain(); }
+	void Reset(Emu &emu);
+
+private:
+	struct Slot {
+		AioRequest req;
+		BlkDev *dev;
+		word_t desc;
+		byte_t *mem;
+	};
+
+	AioEngine *aio;
+	int fd = -1;
+	word_t nblk = 0;
+	word_t ring = 0, size = 0, head = 0, tail = 0;
+	std::atomic<word_t> done { 0 };
+	std::atomic<bool> error { false };
+	Slot slots[MAX_RING];
+
+	void Kick(Emu &emu);
+	bool Prepare(Emu &emu, Slot &slot, word_t desc);
+	static void Complete(AioRequest *req, ssize_t res);
+};
@@ -0,0 +1,47 @@
+#include "coverage.h"
+
+#include <cstring>
+
+void Coverage::Clear()
+{
+	memset(block, 0, sizeof(block));
+	memset(taken, 0, sizeof(taken));
+	memset(fallen, 0, sizeof(fallen));
+	nBits = 0;
+}
+
+static size_t Popcount(uint64_t const *bits, size_t n)
+{
+	size_t cnt = 0;
+	for (size_t i = 0; i < n; ++i)
+		cnt += __builtin_popcountll(bits[i]);
+	return cnt;
+}
+
+size_t Coverage::Blocks() const
+{
+	return Popcount(block, N);
+}
+
+size_t Coverage::Edges() const
+{
+	return Popcount(taken, N) + Popcount(fallen, N);
+}
+
+static size_t MergeBits(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	size_t cnt = 0;
+	for (size_t i = 0; i < n; ++i) {
+		cnt += __builtin_popcountll(src[i] & ~dst[i]);
+		dst[i] |= src[i];
+	}
+	return cnt;
+}
+
+size_t Coverage::Merge(Coverage const &c)
+{
+	size_t cnt = MergeBits(block, c.block, N) + MergeBits(taken, c.taken, N) +
+		MergeBits(fallen, c.fallen, N);
+	nBits += cnt;
+	return cnt;
+}
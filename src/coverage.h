@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Guest code coverage, bit per code word.
+ * Block: entry at word has run. Engines mark it where they see an entry for
+ * the first time (hook, threaded decode), translated code costs nothing
+ * after that. Fused pair or idiom loop is marked as a whole, compare loops
+ * that may exit before their tail runs are not made idioms then.
+ * Edge: conditional branch at word was taken / fell through. Branch stays
+ * interpreted until it went both ways, then it is translated as usual.
+ */
+struct Coverage {
+	enum Mode : uint8_t {
+		COV_OFF,
+		COV_BLOCK,
+		COV_EDGE,	/* block too */
+	};
+	static constexpr size_t WORDS = 32 * 1024;
+	static constexpr size_t N = WORDS / 64;
+
+	Mode mode = COV_OFF;
+	uint64_t block[N];
+	uint64_t taken[N];
+	uint64_t fallen[N];
+	uint64_t nBits = 0; /* set in all maps, grows as new code is reached */
+
+	Coverage() { Clear(); }
+	void Clear();
+	void Mark(size_t pos) { Set(block, pos); }
+	void MarkEdge(size_t pos, bool tk) { Set(tk ? taken : fallen, pos); }
+	bool EdgesDone(size_t pos) const
+	{
+		return (taken[pos / 64] & fallen[pos / 64]) >> pos % 64 & 1;
+	}
+	/* blocks, edges set */
+	size_t Blocks() const;
+	size_t Edges() const;
+	/* add bits of c, returns how many of them were new here */
+	size_t Merge(Coverage const &c);
+
+private:
+	void Set(uint64_t *map, size_t pos)
+	{
+		uint64_t bit = 1ull << pos % 64;
+		if (map[pos / 64] & bit)
+			return;
+		map[pos / 64] |= bit;
+		nBits++;
+	}
+};
+
+/* Instr at word has two successors worth an edge each: bcc or sob */
+static inline bool CovIsBranch(uint16_t op)
+{
+	uint8_t hi = op >> 8;
+	return (hi >= 02 && hi <= 07) || (hi >= 0200 && hi <= 0207) ||
+		(op >> 9) == 0077;
+}
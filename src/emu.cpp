@@ -3,6 +3,56 @@
 #include <cstdint>
 #include <cinttypes>
 #include "common.h"
+#include "loader.h"
+#include "replay.h"
+#include "snapshot.h"
+
+#include <cstring>
+#include <sys/mman.h>
+
+/* dirty flags follow core in one mapping: loader maps over core pages only */
+static constexpr size_t coreMapSz = Emu::CoreMemory::sz +
+	Emu::CoreMemory::sz / Emu::CoreMemory::PAGE;
+
+Emu::CoreMemory::CoreMemory()
+{
+	void *ptr = mmap(NULL, coreMapSz, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ptr == MAP_FAILED)
+		abort();
+	mem = (byte_t*) ptr;
+	dirty = (bool*) (mem + sz);
+}
+
+Emu::CoreMemory::~CoreMemory()
+{
+	munmap(mem, coreMapSz);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+static_assert(offsetof(Emu, genReg.reg) == 0 &&
+		offsetof(Emu, trcache.cache) + sizeof(void*) <= Emu::HOT_LINE,
+		"hot state must fill first line of Emu");
+#pragma GCC diagnostic pop
+
+void *Emu::operator new(size_t sz)
+{
+	void *ptr;
+	if (posix_memalign(&ptr, HOT_LINE, sz))
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void Emu::operator delete(void *ptr)
+{
+	free(ptr);
+}
+
+Emu::~Emu()
+{
+	delete resetPoint;
+}
 
 void Emu::DumpReg(std::ostream &os)
 {
@@ -10,6 +60,17 @@ void Emu::DumpReg(std::ostream &os)
 		os << putf("r%u=%.6" PRIo16 " ", i, genReg[i]);
 }
 
+void Emu::DumpSym(word_t ptr, std::ostream &os)
+{
+	Symbol const *sym;
+	if (!symtab || !(sym = symtab->Lookup(ptr)))
+		return;
+	os << "<" << sym->name;
+	if (ptr != sym->addr)
+		os << putf("+%" PRIo16, (word_t) (ptr - sym->addr));
+	os << ">";
+}
+
 void Emu::DbgStep(std::ostream &os)
 {
 	word_t opcode;
@@ -17,15 +78,30 @@ void Emu::DbgStep(std::ostream &os)
 	DumpReg(os);
 	os << "\n";
 #endif
+	word_t pc = genReg[REG_PC];
+	if (cov.mode && IsPtrAligned<word_t>(pc))
+		cov.Mark(pc / sizeof(word_t));
+	if (HleAt(pc)) {
+		Load(pc, &opcode);
+		HleCall();
+		if (trapPending)
+			goto trapped;
+		return;
+	}
 	FetchOpcode(opcode);
 	if (trapPending)
 		goto trapped;
 #ifdef CONF_DUMP_INSTR
+	DumpSym(genReg[REG_PC] - sizeof(word_t), os);
+	os << "\t";
 	DumpInstr(opcode, os);
 	os << "\n";
 #endif
 	ExecuteInstr(opcode);
 	if (trapPending) goto trapped;
+	if (cov.mode == Coverage::COV_EDGE && CovIsBranch(opcode))
+		cov.MarkEdge(pc / sizeof(word_t),
+				genReg[REG_PC] != pc + sizeof(word_t));
 	return;
 trapped:
 	os << "\tTrap raised: ";
@@ -38,21 +114,128 @@ trapped:
 	return;
 }
 
-void Emu::GenRegFile::ChangeSet(uint8_t newId)
+static char const *const engineNames[Emu::MAX_ENGINE] = {
+	"dbg",		/* ENGINE_DBGSTEP */
+	"step",		/* ENGINE_TRSTEP */
+	"loop",		/* ENGINE_TRLOOP */
+	"inline",	/* ENGINE_INLINE */
+	"threaded",	/* ENGINE_THREADED */
+};
+
+char const *Emu::EngineName(Engine e)
+{
+	return e < MAX_ENGINE ? engineNames[e] : "unknown";
+}
+
+bool Emu::EngineByName(char const *name, Engine *e)
+{
+	for (uint8_t i = 0; i < MAX_ENGINE; ++i) {
+		if (!strcmp(name, engineNames[i])) {
+			*e = (Engine) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Translations differ per engine: entry code, fused handlers */
+int Emu::SetEngine(Engine e)
+{
+	int rc;
+	assert(e < MAX_ENGINE);
+	if (e == ENGINE_INLINE && (rc = trcache.EnableExec()) < 0)
+		return rc;
+	if (e == engine)
+		return 0;
+	engine = e;
+	TrCacheFlush();
+	return 0;
+}
+
+void Emu::SetCoverage(Coverage::Mode mode)
+{
+	cov.Clear();
+	cov.mode = mode;
+	TrCacheFlush();
+}
+
+uint64_t Emu::Run(uint64_t max, std::ostream &os)
+{
+	uint64_t n = 0;
+	if (!max || trapPending || waiting)
+		return 0;
+	TrCacheAcquire();
+	switch (engine) {
+	case ENGINE_TRLOOP:
+	case ENGINE_INLINE:
+		trcache.runMax = max;
+		TrCacheRun(os, max);
+		n = max - (waiting ? trcache.waitBudget : trcache.budget);
+		icount += n;
+		break;
+	case ENGINE_THREADED:
+		trcache.runMax = max;
+		ThreadedRun(os, max);
+		n = max - (waiting ? trcache.waitBudget : trcache.budget);
+		icount += n;
+		break;
+	default:
+		while (n < max && !trapPending && !waiting) {
+			if (engine == ENGINE_TRSTEP) {
+				trcache.runMax = UINT64_MAX; /* TrCacheStep budget */
+				TrCacheStep(os);
+			} else {
+				DbgStep(os);
+			}
+			if (!trapPending) {
+				++n;
+				++icount;
+			}
+		}
+		break;
+	}
+	trcache.runMax = trcache.budget = 0;
+	return n;
+}
+
+void Emu::IOspaceLoadLogged(word_t ptr, byte_t *buf, uint8_t sz)
+{
+	DevInfo dev;
+	if (!IOspaceFind(ptr, dev)) {
+		RaiseTrap(TRAP_MME); return;
+	}
+	uint64_t now = InstrCount();
+	bool trap;
+	if (replay->mode == ReplayLog::MODE_REPLAY) {
+		dev.dev->Sync(*this);
+		if (replay->Replay(now, ptr, buf, sz, &trap)) {
+			if (trap)
+				RaiseTrap(TRAP_MME);
+			return;
+		}
+	}
+	trap = !trapPending;
+	dev.dev->Load(*this, ptr - dev.ptr, buf, sz);
+	trap = trap && trapPending;
+	if (replay->mode == ReplayLog::MODE_RECORD)
+		replay->Record(now, ptr, buf, sz, trap);
+}
+
+void Emu::ChangeRegSet(uint8_t newId)
 {
 	assert(newId == 0 || newId == 1);
-	if (setId != newId) {
-		setId = newId;
+	if (genReg.setId != newId) {
+		genReg.setId = newId;
 		for (uint8_t i = REG_R0; i < REG_SET; ++i)
-			std::swap(savedSet[i], reg[i]);
+			std::swap(regBanks.savedSet[i], genReg.reg[i]);
 	}
 }
 
-void Emu::GenRegFile::ChangeSP(PSWMode newMode)
+void Emu::ChangeSP(PSWMode newMode)
 {
 	assert(newMode < PSW_MODE_MAX);
-	spSet[spMode] = reg[REG_SP];
-	reg[REG_SP] = spSet[spMode = newMode];
+	regBanks.spSet[genReg.spMode] = genReg.reg[REG_SP];
+	genReg.reg[REG_SP] = regBanks.spSet[genReg.spMode = newMode];
 }
 
 void Emu::DumpInstr(word_t opcode, std::ostream &os)
@@ -2,9 +2,11 @@
 #include <iostream>
 #include <cassert>
 #include <vector>
+#include <map>
 #include <csetjmp>
 
 #include "configure.h"
+#include "coverage.h"
 
 using    byte_t = uint8_t;
 using    word_t = uint16_t;
@@ -14,6 +16,9 @@ using s_dword_t =  int32_t;
 
 using trcache_fn_t = void (*)();
 struct trcache_entry;
+struct SymTab;
+struct ReplayLog;
+struct Snapshot;
 struct Emu {
 	enum GenRegId : uint8_t {
 		REG_R0	= 00,
@@ -74,20 +79,42 @@ struct Emu {
 			};
 			word_t raw = 0;
 		};
+		/* FEC, error code of last exception */
+		enum ErrCode : word_t {
+			FEC_OPCODE = 2,
+			FEC_DIVZ   = 4,
+			FEC_ICVT   = 6,	/* float to integer */
+			FEC_OVFLO  = 8,
+			FEC_UNFLO  = 10,
+			FEC_UNDEF  = 12,	/* -0 read */
+		};
 		FPUSW fpusw;
+		word_t fec = 0;
+		word_t fea = 0; /* address of fp instr that raised fec */
+		/*
+		 * Accumulators as host doubles: F/D words are converted only when
+		 * an operand is read or written, arithmetic runs on host values.
+		 */
+		static constexpr uint8_t MAX_AC = 6;
+		double ac[MAX_AC] = { };
 	};
 
-	/* General registers */
+	/* General registers in use */
 	struct GenRegFile {
 		word_t reg[MAX_REG] = { };
-		word_t spSet[PSW_MODE_MAX] = { };
-		word_t savedSet[REG_SET] = { };
 		uint8_t setId = 0;
 		uint8_t spMode = 0;
-		void ChangeSet(uint8_t newId);
-		void ChangeSP(PSWMode newMode);
 		word_t &operator[](uint8_t id) { return reg[id]; /* unaligned sp/pc? */ }
 	};
+	/*
+	 * Registers out of use: general set not selected, sp of other modes.
+	 * A switch copies at most seven words in and out, indexing live ones
+	 * through a bank map would cost a load on every register access.
+	 */
+	struct GenRegBanks {
+		word_t spSet[PSW_MODE_MAX] = { };
+		word_t savedSet[REG_SET] = { };
+	};
 
 	enum TrapId : uint8_t {
 #define DEF_TRAP(name, vec, str) TRAP_##name,
@@ -103,29 +130,112 @@ struct Emu {
 	};
 
 	void RaiseTrap(TrapId const trap) { trapId = trap; trapPending = true; };
+	/* stop after current instr until resumed by owner */
+	void EnterWait()
+	{
+		if (waiting)
+			return;
+		waiting = true;
+		trcache.waitBudget = trcache.budget - 1; /* this one retires */
+		trcache.budget = 1;
+	}
 
 	static constexpr word_t IO_PAGE_BASE = (64 - 4) * 1024;
 
 	struct CoreMemory {
 		friend struct MMU;
 		static constexpr word_t sz = IO_PAGE_BASE;
+		/* granule of write tracking, see snapshot.h */
+		static constexpr size_t PAGE = 256;
 		bool PAExist(word_t ptr) { return ptr < sz; }
-		byte_t *mem;
-		CoreMemory() { mem = new byte_t[sz]; }
-		~CoreMemory() { delete[] mem; }
+		byte_t *mem; /* page aligned, loader may map files over it */
+		bool *dirty; /* page written since last snapshot, mapped past mem */
+		/* core written other than by Store(): DMA, idioms */
+		void Dirty(word_t ptr, size_t len)
+		{
+			for (size_t p = ptr / PAGE; p < (ptr + len + PAGE - 1) / PAGE; ++p)
+				dirty[p] = true;
+		}
+		CoreMemory();
+		~CoreMemory();
 	};
-	static struct TrCache {
-		static constexpr size_t sz = (IO_PAGE_BASE / sizeof(word_t));
-		Emu *emu;
-		trcache_entry *cache;
+	/* Execution engines, all built in, share one set of handlers */
+	enum Engine : uint8_t {
+		ENGINE_DBGSTEP,	/* switch interpreter, one instr per step */
+		ENGINE_TRSTEP,	/* translation cache, one entry per step */
+		ENGINE_TRLOOP,	/* translation cache in loop, 50% faster than dbg */
+		ENGINE_INLINE,	/* amd64 code in translation cache, linked */
+		ENGINE_THREADED, /* computed goto over predecoded instrs, no RWX */
+		MAX_ENGINE
+	};
+	static char const *EngineName(Engine e);
+	/* false if name is unknown */
+	static bool EngineByName(char const *name, Engine *e);
+
+	struct TrCache {
+		/* whole address space: computed pc may point anywhere */
+		static constexpr size_t sz = 0x10000 / sizeof(word_t);
+		/* entries are hook-filled on first use, host page at a time */
+		static constexpr size_t CHUNK = 256;
+		/* hot, these three share Emu's first line, see there */
+		uint64_t budget = 0; /* instrs left until TrCacheRun returns */
+		trcache_fn_t *fn; /* handler called by each entry */
+		trcache_entry *cache; /* as executed, exec view of the mapping */
+		ptrdiff_t wdelta = 0; /* RW view of cache minus exec view */
+		bool filled[sz / CHUNK] = { };
+		static constexpr size_t SHADOW_SZ = 128;
+		void **dyn; /* host target of entries with computed successor */
+		word_t shadow[SHADOW_SZ]; /* guest return pcs of host calls */
+		size_t shadowTop = 0;
+		size_t shadowLost = 0; /* jsr not pushed, shadow was full */
+		bool relink = false; /* host stack out of sync, reenter */
+		uint16_t *hits; /* interpreted runs of not translated entry */
+		uint16_t hotThreshold = 8; /* runs before translation, 0: always */
+		bool fuse = true; /* superinstructions, off for A/B runs */
+		static constexpr size_t MAX_SPAN = 6; /* fused pair, 3 words each */
+		uint8_t *span; /* code words entry was translated from, 0: none */
+		uint8_t *cover; /* translated entries depending on code word */
+		bool exec = false; /* exec view mapped, inline engine */
+		/* threaded engine: handler label and opcode per code word */
+		struct ThrInsn {
+			void const *op; /* NULL: not decoded */
+			word_t opcode;
+		};
+		ThrInsn *thr;
+		bool thrChunk[sz / CHUNK] = { }; /* decoded once, whole */
+		uint32_t thrSlot[sz / CHUNK] = { }; /* pool slot + 1 mapped, 0: own */
+		/* zero is the cold state of all tables: NULL fn runs hook */
+		size_t memsz; /* slots and entries, RW view at dyn */
+		byte_t *xmem = NULL; /* exec view */
+		byte_t *meta; /* hits, span, cover, thr */
+		size_t metasz;
 		jmp_buf restore_buf;
 		word_t trapping_opcode;
+		uint64_t waitBudget; /* real budget left, if stopped by wait */
+		uint64_t relinkCut = 0; /* budget held back to stop for relink */
+		uint64_t runMax = 0; /* budget at Run() start */
 		TrCache();
 		~TrCache();
-	} trcache; // static!!!
+		int EnableExec();
+		void Zero();
+		TrCache(TrCache const &) = delete;
+		TrCache &operator=(TrCache const &) = delete;
+	};
+	static __thread Emu *cur; /* bound to this host thread */
 	void TrCacheAcquire();
+	/* drop all translations, entries start cold again */
+	void TrCacheFlush();
+	/* code in [ptr, ptr+len) changed, drop translations made from it */
+	void TrCacheInvalidate(word_t ptr, size_t len);
+	/* translate entry for ptr before its first run, see warm.h */
+	bool TrCacheWarm(word_t ptr);
 
 	struct DevBase {
+		virtual ~DevBase() { }
+		/* finish async work that may affect guest, used by replay */
+		virtual void Sync(Emu &emu) { }
+		/* back to power-on state, in-flight DMA done, see Emu::Reset */
+		virtual void Reset(Emu &emu) { }
 		virtual void Load(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)=0;
 		virtual void Store(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)=0;
 	};
@@ -136,18 +246,95 @@ struct Emu {
 		DevBase *dev;
 	};
 
+	/*
+	 * Hot state, touched by every instr: first cache line of Emu, at
+	 * offsets checked in emu.cpp so generated code may address it off
+	 * the Emu pointer. Keep cold state below it.
+	 */
+	static constexpr size_t HOT_LINE = 64;
+	alignas(HOT_LINE) GenRegFile genReg;
+	PSW psw;
+	bool trapPending = false; /* =? PSW.val.t */
+	bool waiting = false; /* wait instr executed, no interrupts yet */
+	CoreMemory coreMem;
+	TrCache trcache; /* budget, fn and cache are hot, rest follows */
+
+	Engine engine = ENGINE_DBGSTEP;
+	/*
+	 * Switch engine between Run() calls, translations are dropped.
+	 * Fails if host denies executable memory to the inline engine.
+	 */
+	int SetEngine(Engine e);
+
+	Coverage cov;
+	/*
+	 * Start collecting from scratch: maps are cleared and translations
+	 * dropped, so every entry reports its first run again.
+	 */
+	void SetCoverage(Coverage::Mode mode);
 
 	FPU fpu;
-	GenRegFile genReg;
-	CoreMemory coreMem;
-	PSW psw;
+	GenRegBanks regBanks;
+	/* load another general set / sp of another mode into genReg */
+	void ChangeRegSet(uint8_t newId);
+	void ChangeSP(PSWMode newMode);
 	TrapId trapId;
 	TrapVec trapVec;
-	bool trapPending = false; /* =? PSW.val.t */
+	uint64_t icount = 0; /* instrs retired by Run() */
+	uint64_t snapGen = 0; /* snapshot coreMem.dirty is relative to */
 	std::vector<DevInfo> devices;
+	SymTab const *symtab = NULL;
+	ReplayLog *replay = NULL; /* record/replay device reads */
 
 	void IOspaceRegister(DevInfo &dev) { devices.push_back(dev); }
 
+	/*
+	 * Batch runs of one program: SetResetPoint() once image is loaded,
+	 * then Reset() before each run rewinds dirty core pages, CPU and
+	 * devices to it. Translations of code not written to are kept.
+	 */
+	void SetResetPoint();
+	void Reset();
+
+	/*
+	 * High level emulation: native handler runs in place of guest routine
+	 * entered by jsr pc. It reads args with HleArg(), leaves result in
+	 * r0/r1, then routine returns as if its rts pc executed. Counts as
+	 * one instr in every engine.
+	 */
+	using HleFn = void (*)(Emu &emu, void *arg);
+	struct Hle {
+		HleFn fn;
+		void *arg;
+	};
+	std::map<word_t, Hle> hle;
+	int HleRegister(word_t pc, HleFn fn, void *arg = NULL);
+	/* by symbol, C names are tried with leading underscore too */
+	int HleRegister(char const *sym, HleFn fn, void *arg = NULL);
+	void HleUnregister(word_t pc);
+	Hle const *HleAt(word_t pc) const
+	{
+		if (hle.empty())
+			return NULL;
+		auto it = hle.find(pc);
+		return it == hle.end() ? NULL : &it->second;
+	}
+	/* any handler in [beg, end) */
+	bool HleIn(word_t beg, word_t end) const
+	{
+		auto it = hle.lower_bound(beg);
+		return it != hle.end() && it->first < end;
+	}
+	/* run handler at pc if any, false if there is none */
+	bool HleCall();
+	/* i-th word arg, pushed by caller before jsr */
+	word_t HleArg(unsigned i)
+	{
+		word_t val = 0;
+		Load<word_t>(genReg[REG_SP] + sizeof(word_t) * (i + 1), &val);
+		return val;
+	}
+
 	template<typename T>
 	static bool IsPtrAligned(word_t ptr) {return !(ptr % sizeof(T));}
 
@@ -156,26 +343,66 @@ struct Emu {
 
 	void AdvancePC() { genReg[REG_PC] += sizeof(word_t); }
 	void FetchOpcode(word_t &opcode) { Load(genReg[REG_PC], &opcode); AdvancePC(); }
+	/* word of instr stream after opcode, pc is even once opcode fetched */
+	void FetchImm(word_t &val)
+	{
+		word_t pc = genReg[REG_PC];
+		if (pc < coreMem.sz - 1)
+			val = *(reinterpret_cast<word_t*>(&coreMem.mem[pc]));
+		else
+			Load(pc, &val);
+		AdvancePC();
+	}
 	void ExecuteInstr(word_t opcode);
 
 	void DisasmInstr(word_t opcode, std::ostream &os);
 	void DumpInstr(word_t opcode, std::ostream &os);
 	void DumpTrap(Emu::TrapId t, std::ostream &os);
 	void DumpReg(std::ostream &os);
+	void DumpSym(word_t ptr, std::ostream &os);
 
 	void DbgStep(std::ostream &os);
 
+	/*
+	 * Execute at most max instrs, returns number of retired ones.
+	 * Stops early on trap or wait, may be called again to resume.
+	 */
+	uint64_t Run(uint64_t max, std::ostream &os);
+	/* retired instrs, exact even in the middle of Run() */
+	uint64_t InstrCount()
+	{
+		return icount + (trcache.runMax - trcache.budget -
+				trcache.relinkCut);
+	}
+
 	static trcache_fn_t GetTrCacheExecutor(word_t opcode);
+	/* inline entries with computed successor */
+	static trcache_fn_t GetTrCacheExecutorDyn(word_t opcode);
+	/* one handler for opcode and the instr after it, NULL if none */
+	static trcache_fn_t GetTrCacheFused(word_t opcode, word_t next);
+	/* whole loop at code as one handler, NULL if none, words it spans */
+	static trcache_fn_t GetTrCacheIdiom(word_t const *code, word_t &words);
 
 	static void InitTrCachePc(word_t opcode);
 	static void TrCacheStep(std::ostream &os);
-	static void TrCacheRun(std::ostream &os);
+	static void TrCacheRun(std::ostream &os, uint64_t budget = UINT64_MAX);
+	static void ThreadedRun(std::ostream &os, uint64_t budget);
 
-	Emu() { }
+	Emu()
+	{
+		if (SetEngine(CONF_ENGINE) < 0)
+			SetEngine(ENGINE_THREADED);
+	}
+	~Emu();
+	/* keep hot line aligned on heap too, C++11 new is not */
+	static void *operator new(size_t sz);
+	static void operator delete(void *ptr);
 
 private:
+	Snapshot *resetPoint = NULL; /* owned */
 	bool IOspaceFind(word_t ptr, DevInfo &dev);
 	template<typename T> void IOspaceLoad(word_t ptr, T *val);
+	void IOspaceLoadLogged(word_t ptr, byte_t *buf, uint8_t sz);
 	template<typename T> void IOspaceStore(word_t ptr, T val);
 	template<typename T> bool CheckAlign(word_t ptr);
 };
@@ -194,6 +421,10 @@ inline bool Emu::IOspaceFind(word_t ptr, DevInfo &dev)
 template<typename T>
 inline void Emu::IOspaceLoad(word_t ptr, T *val)
 {
+	if (replay) {
+		IOspaceLoadLogged(ptr, reinterpret_cast<byte_t*>(val), sizeof(*val));
+		return;
+	}
 	DevInfo dev;
 	if (!IOspaceFind(ptr, dev)) {
 		RaiseTrap(TRAP_MME); return;
@@ -243,4 +474,7 @@ inline void Emu::Store(word_t ptr, T val)
 		RaiseTrap(TRAP_MME); return;
 	}
 	*(reinterpret_cast<T*>(&coreMem.mem[ptr])) = val;
+	coreMem.dirty[ptr / CoreMemory::PAGE] = true;
+	if (trcache.cover[ptr / sizeof(word_t)])
+		TrCacheInvalidate(ptr, sizeof(T));
 }
@@ -1,6 +1,36 @@
+switch (masked >> 6) {	// op, 2 bit subop
+	case 00001: I_OP(ldfps);
+	case 00002: I_OP(stfps);
+	case 00003: I_OP(stst);
+	case 00004: I_OP(clrf);
+	case 00005: I_OP(tstf);
+	case 00006: I_OP(absf);
+	case 00007: I_OP(negf);
+
+	default:
+switch (masked >> 8) {	// op, 2 bit ac
+	case 002: I_OP(mulf);
+	case 003: I_OP(modf);
+	case 004: I_OP(addf);
+	case 005: I_OP(ldf);
+	case 006: I_OP(subf);
+	case 007: I_OP(cmpf);
+	case 010: I_OP(stf);
+	case 011: I_OP(divf);
+	case 012: I_OP(stexp);
+	case 013: I_OP(stcfi);
+	case 014: I_OP(stcfd);
+	case 015: I_OP(ldexp);
+	case 016: I_OP(ldcif);
+	case 017: I_OP(ldcdf);
+
+	default:
 switch (masked) {
-	case 00011: I_OP(setd);
+	case 00000: I_OP(cfcc);
+	case 00001: I_OP(setf);
 	case 00002: I_OP(seti);
+	case 00011: I_OP(setd);
+	case 00012: I_OP(setl);
 	default:
 		    I_OP(fpu_unknown);
-};
+}}};
@@ -0,0 +1,236 @@
+#include "fuzz.h"
+#include "loader.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+void FuzzConsole::Load(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)
+{
+	word_t reg = 0;
+	switch (ptr / 2) {
+		case RCSR:
+			if (inPos < inLen)
+				reg = CSR_READY;
+			else
+				emu.EnterWait();
+			break;
+		case RBUF:
+			if (inPos < inLen)
+				reg = in[inPos++];
+			break;
+		case XCSR:
+			reg = CSR_READY;
+			break;
+		default:
+			emu.RaiseTrap(Emu::TRAP_MME);
+			return;
+	}
+	memcpy(buf, (byte_t*) &reg + ptr % 2, sz);
+}
+
+void FuzzConsole::Store(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)
+{
+	if (ptr / 2 != XBUF)
+		emu.RaiseTrap(Emu::TRAP_MME);
+}
+
+Fuzzer::Fuzzer(Emu &_emu) : emu(_emu)
+{
+	Emu::DevInfo info;
+	con.getInfo(info);
+	emu.IOspaceRegister(info);
+	if (!emu.cov.mode)
+		emu.SetCoverage(Coverage::COV_EDGE);
+}
+
+int Fuzzer::Prepare(uint64_t max)
+{
+	con.Feed(NULL, 0);
+	emu.Run(max, os);
+	if (emu.trapPending)
+		return -EFAULT;
+	if (!emu.waiting)
+		return -ETIMEDOUT;
+	emu.waiting = false;
+	snap.Take(emu);
+	return 0;
+}
+
+/* guest ran into halt, as crt0 does after main() returns */
+bool Fuzzer::Halted()
+{
+	word_t pc = emu.genReg[Emu::REG_PC] - sizeof(word_t);
+	return emu.trapId == Emu::TRAP_ILL && pc < emu.coreMem.sz &&
+		!*reinterpret_cast<word_t*>(&emu.coreMem.mem[pc]);
+}
+
+Fuzzer::Result Fuzzer::Exec(byte_t const *data, size_t len)
+{
+	Result r;
+	uint64_t bits = emu.cov.nBits;
+	snap.Restore(emu);
+	con.Feed(data, len);
+	r.instrs = emu.Run(budget, os);
+	r.newCov = emu.cov.nBits - bits;
+	r.crashed = emu.trapPending && !Halted();
+	r.hang = !emu.trapPending && !emu.waiting;
+	nExecs++;
+	return r;
+}
+
+/******************************** main -z *************************************/
+
+struct FuzzJob {
+	unsigned id;
+	int rc = 0;
+	uint64_t execs = 0, crashes = 0, corpus = 0;
+	Coverage cov;
+};
+
+static std::atomic<int64_t> fuzzLeft;
+
+static uint64_t Rand(uint64_t &s)
+{
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 0x2545f4914f6cdd1dull;
+}
+
+using Input = std::vector<byte_t>;
+
+static void Mutate(Input &in, std::vector<Input> const &corpus, uint64_t &rng)
+{
+	static constexpr size_t MAX_LEN = 256;
+	for (unsigned n = 1 + Rand(rng) % 4; n; --n) {
+		size_t pos = in.empty() ? 0 : Rand(rng) % in.size();
+		switch (Rand(rng) % 6) {
+		case 0:
+			if (!in.empty())
+				in[pos] ^= 1 << Rand(rng) % 8;
+			break;
+		case 1:
+			if (!in.empty())
+				in[pos] = Rand(rng);
+			break;
+		case 2:
+			in.insert(in.begin() + pos, (byte_t) Rand(rng));
+			break;
+		case 3:
+			if (!in.empty())
+				in.erase(in.begin() + pos);
+			break;
+		case 4: /* guests read lines */
+			in.insert(in.begin() + pos, '\n');
+			break;
+		case 5: { /* tail from other input */
+			Input const &o = corpus[Rand(rng) % corpus.size()];
+			in.resize(pos);
+			in.insert(in.end(), o.begin() + std::min(pos, o.size()),
+					o.end());
+			break;
+		}
+		}
+		if (in.size() > MAX_LEN)
+			in.resize(MAX_LEN);
+	}
+}
+
+static int SaveCrash(FuzzJob &job, Input const &in)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "crash-%u-%llu", job.id,
+			(unsigned long long) job.crashes);
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	ssize_t rc = write(fd, in.data(), in.size());
+	close(fd);
+	return rc == (ssize_t) in.size() ? 0 : -EIO;
+}
+
+static void FuzzJobRun(FuzzJob *job, char const *path, word_t load_addr,
+		Emu::Engine engine)
+{
+	std::unique_ptr<Emu> emu(new Emu);
+	Image img;
+	if ((job->rc = emu->SetEngine(engine)) < 0)
+		return;
+	if ((job->rc = LoadImage(*emu, path, img, load_addr)) < 0)
+		return;
+	if (!img.hasEntry) {
+		job->rc = -ENOEXEC;
+		return;
+	}
+	emu->symtab = &img.symtab;
+	emu->genReg[Emu::REG_PC] = img.entry;
+
+	Fuzzer fz(*emu);
+	if ((job->rc = fz.Prepare(UINT32_MAX)) < 0)
+		return;
+
+	std::vector<Input> corpus { { '\n' } };
+	Input in;
+	uint64_t rng = 0x9e3779b97f4a7c15ull * (job->id + 1);
+	while (fuzzLeft.fetch_sub(1, std::memory_order_relaxed) > 0) {
+		in = corpus[Rand(rng) % corpus.size()];
+		Mutate(in, corpus, rng);
+		Fuzzer::Result r = fz.Exec(in.data(), in.size());
+		if (r.newCov)
+			corpus.push_back(in);
+		/* crash is unique if it took a path no input did before */
+		if (r.crashed && (r.newCov || !job->crashes)) {
+			job->crashes++;
+			if (SaveCrash(*job, in) < 0)
+				std::cerr << "fuzz: crash input not saved\n";
+		}
+	}
+	job->execs = fz.nExecs;
+	job->corpus = corpus.size();
+	job->cov = emu->cov;
+}
+
+int FuzzMain(char const *path, word_t load_addr, Emu::Engine engine,
+		uint64_t execs, unsigned jobs)
+{
+	if (!jobs)
+		jobs = std::max(1u, std::thread::hardware_concurrency());
+	fuzzLeft = execs;
+
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<FuzzJob> job(jobs);
+	std::vector<std::thread> thr;
+	for (unsigned i = 0; i < jobs; ++i) {
+		job[i].id = i;
+		thr.emplace_back(FuzzJobRun, &job[i], path, load_addr, engine);
+	}
+	for (auto &t : thr)
+		t.join();
+	std::chrono::duration<double> sec =
+		std::chrono::steady_clock::now() - t0;
+
+	Coverage total;
+	uint64_t n = 0, crashes = 0, corpus = 0;
+	for (auto &j : job) {
+		if (j.rc < 0)
+			return j.rc;
+		n += j.execs;
+		crashes += j.crashes;
+		corpus += j.corpus;
+		total.Merge(j.cov);
+	}
+	std::cout << "fuzz: " << n << " execs in " << sec.count() << "s, " <<
+		(uint64_t) (n / sec.count()) << "/s on " << jobs << " jobs\n";
+	std::cout << "fuzz: " << total.Blocks() << " instrs, " <<
+		total.Edges() << " branch edges, corpus " << corpus <<
+		", crashes " << crashes << "\n";
+	return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "emu.h"
+#include "snapshot.h"
+
+/*
+ * DL11 console stub at DummyVT's address, input comes from a buffer and
+ * output is dropped. Reading RCSR once input is used up stops the run,
+ * guest could only poll from there.
+ */
+struct FuzzConsole : public Emu::DevBase {
+	enum RegId : word_t {
+		RCSR = 0,
+		RBUF = 1,
+		XCSR = 2,
+		XBUF = 3,
+		MAX_REG,
+	};
+	static constexpr word_t CSR_READY = 0x80;
+
+	static constexpr word_t BASE_ADDR = 0177560;
+	static constexpr word_t ADDR_LEN = MAX_REG * sizeof(word_t);
+
+	void getInfo(Emu::DevInfo &info)
+	{
+		info.ptr = BASE_ADDR;
+		info.len = ADDR_LEN;
+		info.dev = this;
+	}
+	void Feed(byte_t const *data, size_t len)
+	{
+		in = data;
+		inLen = len;
+		inPos = 0;
+	}
+
+	void Load(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz);
+	void Store(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz);
+	void Reset(Emu &emu) { Feed(NULL, 0); }
+
+private:
+	byte_t const *in = NULL;
+	size_t inLen = 0, inPos = 0;
+};
+
+/*
+ * In-process fuzzing of guest input handling, libFuzzer style.
+ * Guest runs once up to its first console read and is snapshotted there,
+ * every input starts from the snapshot with only dirty pages rewound and
+ * translations kept. Coverage is cumulative: input is interesting when
+ * it reached bits no input before did.
+ * One Fuzzer per Emu, independent instances scale over host threads.
+ */
+struct Fuzzer {
+	struct Result {
+		uint64_t instrs;
+		uint64_t newCov;	/* coverage bits first reached */
+		bool crashed;		/* trapped, halt is a normal exit */
+		bool hang;		/* budget ran out */
+	};
+
+	uint64_t budget = 1 << 20;	/* instrs per input */
+	uint64_t nExecs = 0;
+
+	/* registers console, coverage is enabled if it is off */
+	Fuzzer(Emu &_emu);
+	/* run to input read, -ETIMEDOUT if none in max instrs */
+	int Prepare(uint64_t max);
+	Result Exec(byte_t const *data, size_t len);
+
+private:
+	Emu &emu;
+	FuzzConsole con;
+	Snapshot snap;
+	std::ostream os { NULL }; /* trap reports dropped */
+	bool Halted();
+};
+
+/*
+ * main -z: mutational fuzzing of image on jobs threads, an Emu each.
+ * Inputs that crash the guest are saved to crash-<job>-<n> files.
+ */
+int FuzzMain(char const *path, word_t load_addr, Emu::Engine engine,
+		uint64_t execs, unsigned jobs);
@@ -0,0 +1,55 @@
+#include "emu.h"
+#include "loader.h"
+
+#include <cerrno>
+#include <string>
+
+/*
+ * Handler replaces translation of the entry at pc: Invalidate drops it, next
+ * run translates to trwrapper_hle (threaded: thr_hle) instead of guest code.
+ */
+int Emu::HleRegister(word_t pc, HleFn fn, void *arg)
+{
+	if (!fn || !IsPtrAligned<word_t>(pc) || pc >= coreMem.sz)
+		return -EINVAL;
+	hle[pc] = Hle { fn, arg };
+	TrCacheInvalidate(pc, sizeof(word_t));
+	return 0;
+}
+
+int Emu::HleRegister(char const *sym, HleFn fn, void *arg)
+{
+	if (!symtab)
+		return -ENOENT;
+	Symbol const *s = symtab->Find(sym);
+	if (!s)
+		s = symtab->Find(("_" + std::string(sym)).c_str());
+	if (!s)
+		return -ENOENT;
+	return HleRegister(s->addr, fn, arg);
+}
+
+void Emu::HleUnregister(word_t pc)
+{
+	if (hle.erase(pc))
+		TrCacheInvalidate(pc, sizeof(word_t));
+}
+
+bool Emu::HleCall()
+{
+	word_t &sp = genReg[REG_SP];
+	word_t ret;
+	Hle const *h = HleAt(genReg[REG_PC]);
+	if (!h)
+		return false;
+	h->fn(*this, h->arg);
+	if (trapPending)
+		return true;
+	/* rts pc */
+	Load(sp, &ret);
+	if (trapPending)
+		return true;
+	genReg[REG_PC] = ret;
+	sp += sizeof(word_t);
+	return true;
+}
@@ -3,47 +3,48 @@
 #include "common.h"
 
 #include "trcache.h"
+#include <cmath>
+#include <cstring>
 
 #define TRWRAPPER_I(instr) trwrapper_##instr
 
-#ifdef CONF_ENABLE_TRCACHE
-#ifdef CONF_ENABLE_TRCACHE_RUN_INLINE
+#define TRWRAPPER_CHECK(emu, opcode) do {					\
+	if (emu.trapPending) {							\
+		emu.trcache.trapping_opcode = opcode;				\
+		longjmp(emu.trcache.restore_buf, 1);				\
+	}									\
+	if (!--emu.trcache.budget)						\
+		longjmp(emu.trcache.restore_buf, 1);				\
+} while (0)
+
+/*
+ * Handlers shared by all translation cache engines.
+ * Result is "branch taken", used by inline entries linking the successor.
+ * dyn variant is for inline entries with computed successor.
+ */
 #define DEF_TRWRAPPER(instr)							\
-void trwrapper_##instr () {							\
-	Emu &emu = *Emu::trcache.emu;						\
+bool trwrapper_##instr () {							\
+	Emu &emu = *Emu::cur;							\
 	word_t opcode;								\
 	emu.FetchOpcode(opcode);						\
 	auto oldpc = emu.genReg[Emu::REG_PC];					\
 	EXECUTE_I(instr, opcode, emu);						\
-	if (emu.trapPending) {							\
-		Emu::trcache.trapping_opcode = opcode;				\
-		longjmp(Emu::trcache.restore_buf, 1);				\
-	}									\
+	TRWRAPPER_CHECK(emu, opcode);						\
+	return emu.genReg[Emu::REG_PC] != oldpc;				\
+}										\
+void trwrapper_dyn_##instr () {							\
+	Emu &emu = *Emu::cur;							\
+	word_t opcode;								\
+	emu.FetchOpcode(opcode);						\
+	EXECUTE_I(instr, opcode, emu);						\
+	TRWRAPPER_CHECK(emu, opcode);						\
 	auto newpc = emu.genReg[Emu::REG_PC];					\
-	size_t offs = (newpc - oldpc) / sizeof(word_t) * sizeof(trcache_entry);	\
-	frame_retaddr_shift(offs);						\
-}						
-#else
-#define DEF_TRWRAPPER(instr)				\
-void trwrapper_##instr () {				\
-	Emu &emu = *Emu::trcache.emu;			\
-	word_t opcode;					\
-	emu.FetchOpcode(opcode);			\
-	EXECUTE_I(instr, opcode, emu);			\
-	if (emu.trapPending) {				\
-		Emu::trcache.trapping_opcode = opcode;	\
-		longjmp(Emu::trcache.restore_buf, 1);	\
-	}						\
-}
-#endif
+	*emu.trcache.dyn = TrCacheEntry(emu.trcache, newpc);			\
+}
 #define DEF_EXECUTE(instr)						\
 static inline void Execute_##instr(word_t opcode, struct Emu &emu);	\
 DEF_TRWRAPPER(instr)							\
 static inline void Execute_##instr(word_t opcode, struct Emu &emu)
-#else
-#define DEF_EXECUTE(instr)						\
-static inline void Execute_##instr(word_t opcode, struct Emu &emu)
-#endif
 
 #define DEF_DISASMS(instr) static inline void		\
 	Disasms_##instr(word_t opcode, struct Emu &emu, std::ostream &os)
@@ -95,6 +96,8 @@ struct AddrOp {
 		uint8_t reg;
 	} effAddr;
 	bool isReg;
+	bool isImm; /* #imm, value read with instr stream, Store goes to ptr */
+	word_t imm;
 
 	uint8_t op_mode;
 	uint8_t op_reg;
@@ -218,11 +221,9 @@ struct InstrOp_r {
 template <typename T>
 inline void AddrOp::Fetch(Emu &emu)	// Execute unit to get effAddr, may abort
 {
-	word_t &pc = emu.genReg[Emu::REG_PC];
 	word_t &reg = emu.genReg[op_reg];
-	word_t imm;
 
-	isReg = false;
+	isReg = isImm = false;
 	switch (op_mode) {
 	case 0b000: // R
 		isReg = true;
@@ -232,11 +233,21 @@ inline void AddrOp::Fetch(Emu &emu)	// Execute unit to get effAddr, may abort
 		effAddr.ptr = reg;
 		break;
 	case 0b010: // (R)+
+		if (op_reg == Emu::REG_PC) { /* #imm */
+			isImm = true;
+			effAddr.ptr = reg;
+			emu.FetchImm(imm);
+			break;
+		}
 		effAddr.ptr = reg;
 		reg += (op_reg < Emu::REG_SP) ? sizeof(T) : sizeof(word_t);
 		// sp trap
 		break;
 	case 0b011: // *(R)+
+		if (op_reg == Emu::REG_PC) { /* @#abs */
+			emu.FetchImm(effAddr.ptr);
+			break;
+		}
 		emu.Load<word_t>(reg, &effAddr.ptr);
 		reg += sizeof(word_t);
 		// sp trap
@@ -252,13 +263,11 @@ inline void AddrOp::Fetch(Emu &emu)	// Execute unit to get effAddr, may abort
 		emu.Load<word_t>(reg, &effAddr.ptr);
 		break;
 	case 0b110: // imm(R)
-		emu.Load<word_t>(pc, &imm);
-		pc += sizeof(word_t);
+		emu.FetchImm(imm);
 		effAddr.ptr = reg + imm;
 		break;
 	case 0b111: // *imm(R)
-		emu.Load<word_t>(pc, &imm);
-		pc += sizeof(word_t);
+		emu.FetchImm(imm);
 		emu.Load<word_t>(reg + imm, &effAddr.ptr);
 		break;
 	}
@@ -269,6 +278,8 @@ inline void AddrOp::Load(Emu &emu, T *val) // may abort
 {
 	if (isReg)
 		*val = emu.genReg[effAddr.reg];
+	else if (isImm)
+		*val = (T) imm; /* byte is the low one, at ptr */
 	else
 		emu.Load<T>(effAddr.ptr, val);
 }
@@ -661,6 +672,106 @@ DEF_EXECUTE(mul) {
 }
 DEF_DISASMS(mul) { InstrOp_rmr(opcode).DisasmRSS(os); }
 
+/* 32 by 16 bit; zero divisor or quotient out of range leaves regs alone */
+DEF_EXECUTE(div) {
+	PREF_RMR; word_t aopv; int64_t dvd, dvs, quo;
+	op.a.Load(emu, &aopv);
+	uint8_t reg = op.r.effAddr.reg;
+	dvd = (s_dword_t) ((dword_t) emu.genReg[reg] << 16 | emu.genReg[reg | 1]);
+	dvs = (s_word_t) aopv;
+
+	if (!dvs) {
+		emu.psw.n = 0;
+		emu.psw.z = emu.psw.v = emu.psw.c = 1;
+		return;
+	}
+	quo = dvd / dvs;
+	if (quo > 077777 || quo < -0100000) {
+		emu.psw.n = emu.psw.z = emu.psw.c = 0;
+		emu.psw.v = 1;
+		return;
+	}
+	emu.genReg[reg    ] = quo;
+	emu.genReg[reg | 1] = dvd % dvs;
+
+	emu.psw.n = quo < 0;
+	emu.psw.z = !quo;
+	emu.psw.v = emu.psw.c = 0;
+}
+DEF_DISASMS(div) { InstrOp_rmr(opcode).DisasmRSS(os); }
+
+/*
+ * Odd register is both halves of the 32-bit value and gets the low one,
+ * so right shift rotates it.
+ */
+DEF_EXECUTE(ashc) {
+	PREF_RMR; word_t aopv; dword_t val; int64_t ext, res;
+	op.a.Load(emu, &aopv);
+	uint8_t reg = op.r.effAddr.reg;
+	val = (dword_t) emu.genReg[reg] << 16 | emu.genReg[reg | 1];
+	ext = (s_dword_t) val;
+
+	unsigned n = aopv & 077;
+	if (n & 040) {
+		n = 0100 - n;
+		res = ext >> n;
+		emu.psw.v = 0;
+		emu.psw.c = (ext >> (n - 1)) & 1;
+	} else {
+		res = (int64_t) ((uint64_t) ext << n);
+		/* sign changed on the way if any bit shifted through it differs */
+		emu.psw.v = res != (s_dword_t) res;
+		emu.psw.c = n && ((val >> (32 - n)) & 1);
+	}
+	val = res;
+
+	emu.genReg[reg    ] = val >> 16;
+	emu.genReg[reg | 1] = val & 0xffff;
+
+	emu.psw.n = getSign(val);
+	emu.psw.z = getZ(val);
+}
+DEF_DISASMS(ashc) { InstrOp_rmr(opcode).DisasmRSS(os); }
+
+DEF_EXECUTE(xor) {
+	PREF_RMR; word_t aopv, regv, val;
+	op.r.Load(emu, &regv);
+	op.a.Load(emu, &aopv);
+	val = regv ^ aopv;
+	op.a.Store(emu, val);
+
+	emu.psw.n = getSign(val);
+	emu.psw.z = getZ(val);
+	emu.psw.v = 0;
+}
+DEF_DISASMS(xor) { InstrOp_rmr(opcode).DisasmRDD(os); }
+
+/* flags untouched; offset is words back from the next instr */
+DEF_EXECUTE(sob) {
+	uint8_t reg = (opcode >> 6) & 7;
+	if (--emu.genReg[reg])
+		emu.genReg[Emu::REG_PC] -= sizeof(word_t) * (opcode & 077);
+}
+DEF_DISASMS(sob) { os << putf(" r%d, pc-", (opcode >> 6) & 7) << (opcode & 077); }
+
+/*
+ * Loop closing sob in translation cache: counter register is fixed per
+ * handler, nothing is left to decode but the offset.
+ */
+template <uint8_t R>
+static bool trsob()
+{
+	Emu &emu = *Emu::cur;
+	auto &pc = emu.genReg[Emu::REG_PC];
+	word_t opcode;
+	emu.FetchOpcode(opcode);
+	bool taken = --emu.genReg[R];
+	if (taken)
+		pc -= sizeof(word_t) * (opcode & 077);
+	TRWRAPPER_CHECK(emu, opcode);
+	return taken;
+}
+
 DEF_EXECUTE(jsr) {
 	PREF_RMR;
 	if (op.a.isReg)	{ /* jsr r, r illegal */ 
@@ -690,21 +801,89 @@ DEF_EXECUTE(rts) {
 }
 DEF_DISASMS(rts) { InstrOp_r(opcode).Disasm(os); }
 
+/*
+ * Inline engine: jsr entry host-calls the callee entry, so rts entry may
+ * just "ret" if the guest returns where it was called from: shadow stack
+ * keeps guest return pcs of host frames. On mismatch host stack is unwound
+ * by reentry.
+ */
+void trwrapper_call_jsr()
+{
+	Emu &emu = *Emu::cur;
+	auto &tc = emu.trcache;
+	word_t opcode;
+	emu.FetchOpcode(opcode);
+	EXECUTE_I(jsr, opcode, emu);
+	TRWRAPPER_CHECK(emu, opcode);
+	auto target = TrCacheEntry(tc, emu.genReg[Emu::REG_PC]);
+	if (tc.shadowTop == Emu::TrCache::SHADOW_SZ) {
+		tc.shadowLost++;
+		frame_retaddr_set(target);
+		return;
+	}
+	uint8_t reg = (opcode >> 6) & 7;
+	word_t link = emu.genReg[reg];
+	if (reg == Emu::REG_PC)
+		emu.Load(emu.genReg[Emu::REG_SP], &link);
+	tc.shadow[tc.shadowTop++] = link;
+	*tc.dyn = target;
+}
+
+/* Host side of guest return: NULL if shadow stack predicted it */
+static trcache_entry *TrRetLink(Emu &emu)
+{
+	auto &tc = emu.trcache;
+	word_t pc = emu.genReg[Emu::REG_PC];
+	if (tc.shadowLost || !tc.shadowTop) {
+		if (tc.shadowLost)
+			tc.shadowLost--;
+		return TrCacheEntry(tc, pc);
+	}
+	if (tc.shadow[--tc.shadowTop] == pc)
+		return NULL;
+	tc.relink = true;
+	longjmp(tc.restore_buf, 1);
+}
+
+void trwrapper_ret_rts()
+{
+	Emu &emu = *Emu::cur;
+	word_t opcode;
+	emu.FetchOpcode(opcode);
+	EXECUTE_I(rts, opcode, emu);
+	TRWRAPPER_CHECK(emu, opcode);
+	if (trcache_entry *e = TrRetLink(emu))
+		frame_retaddr_set(e);
+}
+
+/* Native routine, inline entry returns from it like from rts */
+void trwrapper_hle()
+{
+	Emu &emu = *Emu::cur;
+	word_t opcode;
+	emu.Load(emu.genReg[Emu::REG_PC], &opcode);
+	emu.HleCall();
+	TRWRAPPER_CHECK(emu, opcode);
+	if (emu.engine != Emu::ENGINE_INLINE)
+		return;
+	if (trcache_entry *e = TrRetLink(emu))
+		frame_retaddr_set(e);
+}
+
 
 DEF_EXECUTE(halt) { emu.RaiseTrap(Emu::TRAP_ILL); }
 DEF_DISASMS(halt) { }
 
+/* No interrupts: stop and let the owner resume us (Scheduler::Wake) */
+DEF_EXECUTE(wait) { emu.EnterWait(); }
+DEF_DISASMS(wait) { }
+
 
 #define DEF_UNIMPL(name)				\
 DEF_EXECUTE(name) { emu.RaiseTrap(Emu::TRAP_ILL); }	\
 DEF_DISASMS(name) { os << ": unimplemented"; }
 
 
-DEF_UNIMPL(ashc)
-DEF_UNIMPL(div)
-DEF_UNIMPL(xor)
-DEF_UNIMPL(sob)
-
 DEF_UNIMPL(emt)
 DEF_UNIMPL(trap)
 
@@ -734,7 +913,6 @@ DEF_UNIMPL(mfpd)
 
 DEF_UNIMPL(spl)
 
-DEF_UNIMPL(wait)
 DEF_UNIMPL(rti)
 DEF_UNIMPL(bpt)
 DEF_UNIMPL(iot)
@@ -743,15 +921,641 @@ DEF_UNIMPL(rtt)
 
 /******************************** FPU ISA *************************************/
 
-DEF_EXECUTE(fpu_unknown) { emu.RaiseTrap(Emu::TRAP_ILL); }
+/*
+ * FP11 on host doubles. Accumulators hold host values, F/D words are
+ * converted only when an operand goes to or from memory.
+ * F results round exactly as FP11 does (half away from zero, or chop if
+ * FPS.FT): the host result is rounded to 53 bits first, which for add,
+ * sub, mul and div of 24-bit operands cannot move the 24-bit rounding,
+ * and is turned into a chop by the sign of the exact error term when FT
+ * is set.
+ * D keeps 53 of its 56 fraction bits in accumulators; ops with memory
+ * operand only (absf, negf, tstf) and ldcdf work on the words, exactly.
+ */
+
+/* FP11 value as one 64-bit word: sign, excess 0200 exponent, 55-bit fraction */
+static constexpr uint64_t FP_SIGN = 1ull << 63;
+static constexpr unsigned FP_FRAC = 55;
+static constexpr uint64_t FP_FRAC_MASK = (1ull << FP_FRAC) - 1;
+static constexpr uint64_t FP_EXP_MASK = 0377ull << FP_FRAC;
+/* 0.1f * 2^(e-0200) is 1.f * 2^(e-0201), IEEE biased exponent is e + this */
+static constexpr int FP_IEEE_EXP = 1023 - 0201;
+/* host bits below F fraction */
+static constexpr unsigned FP_F_CHOP = 52 - 23;
+
+static inline uint64_t FpBits(double r)
+{
+	uint64_t b;
+	memcpy(&b, &r, sizeof(b));
+	return b;
+}
+
+static inline double FpHost(uint64_t b)
+{
+	double r;
+	memcpy(&r, &b, sizeof(r));
+	return r;
+}
+
+static inline unsigned FpExp(uint64_t m) { return (m & FP_EXP_MASK) >> FP_FRAC; }
+
+/* exponent 0 is zero whatever the fraction is; D goes to nearest 53 bits */
+static inline double FpToHost(uint64_t m)
+{
+	uint64_t exp = FpExp(m);
+	if (!exp)
+		return 0.0;
+	uint64_t frac = m & FP_FRAC_MASK;
+	uint64_t b = ((exp + FP_IEEE_EXP) << 52) + (frac >> 3);
+	uint64_t rest = frac & 7;
+	b += rest > 4 || (rest == 4 && (b & 1));
+	return FpHost(b | (m & FP_SIGN));
+}
+
+/* r is 0 or in FP11 range, exact in D; F takes the high half (chop) */
+static inline uint64_t FpFromHost(double r)
+{
+	uint64_t b = FpBits(r);
+	if (!(b & ~FP_SIGN))
+		return 0;
+	uint64_t exp = ((b >> 52) & 03777) - FP_IEEE_EXP;
+	return (b & FP_SIGN) | exp << FP_FRAC | (b & ((1ull << 52) - 1)) << 3;
+}
+
+/* FP11 exponent of host value, out of 1..0377 if it does not fit */
+static inline int FpHostExp(double r)
+{
+	return (int) ((FpBits(r) >> 52) & 03777) - FP_IEEE_EXP;
+}
+
+/* to 24-bit fraction: half away from zero, or chop */
+static inline double FpRoundF(double r, bool chop)
+{
+	uint64_t b = FpBits(r);
+	if (!chop)
+		b += 1ull << (FP_F_CHOP - 1);
+	return FpHost(b & ~((1ull << FP_F_CHOP) - 1));
+}
+
+/* exception: recorded if enabled, traps unless FPS.FID; true if trapped */
+static bool FpError(Emu &emu, word_t fec, bool enabled, word_t at)
+{
+	auto &fpu = emu.fpu;
+	if (!enabled)
+		return false;
+	fpu.fec = fec;
+	fpu.fea = at;
+	fpu.fpusw.fer = 1;
+	if (fpu.fpusw.fid)
+		return false;
+	emu.RaiseTrap(Emu::TRAP_FPE);
+	return true;
+}
+
+static inline void FpSetCC(Emu::FPU::FPUSW &fps, double r)
+{
+	fps.fn = r < 0;
+	fps.fz = r == 0;
+	fps.fv = fps.fc = 0;
+}
+
+/*
+ * Result of arithmetic to accumulator format, err is exact result - r
+ * (only looked at when chopping). Out of range: 0, or exponent wrapped by
+ * 0400 if the exception traps.
+ */
+static void FpResult(Emu &emu, double &r, double err, bool dbl, word_t at)
+{
+	auto &fps = emu.fpu.fpusw;
+	if (fps.ft && err != 0 && (err < 0) != (r < 0))
+		r = nextafter(r, 0.0);
+	if (!dbl)
+		r = FpRoundF(r, fps.ft);
+	bool ovf = false;
+	if (r != 0) {
+		int exp = FpHostExp(r);
+		if (exp > 0377) {
+			ovf = true;
+			if (FpError(emu, Emu::FPU::FEC_OVFLO, fps.iv, at))
+				r = ldexp(r, -0400);
+			else
+				r = 0;
+		} else if (exp < 1) {
+			if (FpError(emu, Emu::FPU::FEC_UNFLO, fps.iu, at))
+				r = ldexp(r, 0400);
+			else
+				r = 0;
+		}
+	}
+	r += 0.0; /* no -0, it is the undefined variable */
+	FpSetCC(fps, r);
+	fps.fv = ovf;
+}
+
+/* FP11 operand: accumulator for mode 0, else core address of len bytes */
+struct FpAddr {
+	word_t ptr;
+	uint8_t reg;
+	bool isReg, isImm; /* #imm is one word, rest reads as 0 */
+
+	void Fetch(Emu &emu, word_t spec, word_t len);
+	unsigned Words(word_t len) const { return isImm ? 1 : len / sizeof(word_t); }
+};
+
+/* as AddrOp::Fetch, autoinc/dec steps by operand length but for pc */
+inline void FpAddr::Fetch(Emu &emu, word_t spec, word_t len)
+{
+	uint8_t mode = (spec >> 3) & 7;
+	reg = spec & 7;
+	word_t &r = emu.genReg[reg];
+	word_t imm;
+
+	isReg = isImm = false;
+	switch (mode) {
+	case 0b000:
+		isReg = true;
+		break;
+	case 0b001:
+		ptr = r;
+		break;
+	case 0b010:
+		ptr = r;
+		isImm = reg == Emu::REG_PC;
+		r += isImm ? sizeof(word_t) : len;
+		break;
+	case 0b011:
+		if (reg == Emu::REG_PC) {
+			emu.FetchImm(ptr);
+			break;
+		}
+		emu.Load<word_t>(r, &ptr);
+		r += sizeof(word_t);
+		break;
+	case 0b100:
+		r -= reg == Emu::REG_PC ? sizeof(word_t) : len;
+		ptr = r;
+		break;
+	case 0b101:
+		r -= sizeof(word_t);
+		emu.Load<word_t>(r, &ptr);
+		break;
+	case 0b110:
+		emu.FetchImm(imm);
+		ptr = r + imm;
+		break;
+	case 0b111:
+		emu.FetchImm(imm);
+		emu.Load<word_t>(r + imm, &ptr);
+		break;
+	}
+}
+
+/* high word first, as FP11 and long integers are laid out */
+static inline uint64_t FpReadMem(Emu &emu, FpAddr const &a, word_t len)
+{
+	uint64_t m = 0;
+	for (unsigned i = 0; i < a.Words(len); ++i) {
+		word_t w;
+		emu.Load<word_t>(a.ptr + i * sizeof(word_t), &w);
+		if (emu.trapPending)
+			return 0;
+		m |= (uint64_t) w << (48 - 16 * i);
+	}
+	return m;
+}
+
+static inline void FpWriteMem(Emu &emu, FpAddr const &a, word_t len, uint64_t m)
+{
+	for (unsigned i = 0; i < a.Words(len) && !emu.trapPending; ++i)
+		emu.Store<word_t>(a.ptr + i * sizeof(word_t), m >> (48 - 16 * i));
+}
+
+static inline word_t FpLen(bool dbl) { return dbl ? 8 : 4; }
+
+/* accumulator of mode 0 operand, ac6/ac7 do not exist */
+static inline double *FpAc(Emu &emu, FpAddr const &a, word_t at)
+{
+	if (a.reg < Emu::FPU::MAX_AC)
+		return &emu.fpu.ac[a.reg];
+	FpError(emu, Emu::FPU::FEC_OPCODE, true, at);
+	return NULL;
+}
+
+/* -0 in memory, traps if FPS.FIUV */
+static inline bool FpUndef(Emu &emu, uint64_t m, word_t at)
+{
+	if ((m & FP_SIGN) && !FpExp(m))
+		return FpError(emu, Emu::FPU::FEC_UNDEF, emu.fpu.fpusw.iuv, at);
+	return false;
+}
+
+/* FSRC in F or D format as host value; false if it trapped */
+static bool FpSrc(Emu &emu, word_t spec, bool dbl, double *val, word_t at)
+{
+	FpAddr a;
+	a.Fetch(emu, spec, FpLen(dbl));
+	if (emu.trapPending)
+		return false;
+	if (a.isReg) {
+		double *ac = FpAc(emu, a, at);
+		if (ac)
+			*val = *ac;
+		return ac;
+	}
+	uint64_t m = FpReadMem(emu, a, FpLen(dbl));
+	if (emu.trapPending || FpUndef(emu, m, at))
+		return false;
+	*val = FpToHost(m);
+	return true;
+}
+
+/* FDST in F or D format; F chops as FP11 stores the high words */
+static void FpDst(Emu &emu, word_t spec, bool dbl, double val, word_t at)
+{
+	FpAddr a;
+	a.Fetch(emu, spec, FpLen(dbl));
+	if (emu.trapPending)
+		return;
+	if (a.isReg) {
+		if (double *ac = FpAc(emu, a, at))
+			*ac = dbl ? val : FpRoundF(val, true);
+		return;
+	}
+	FpWriteMem(emu, a, FpLen(dbl), FpFromHost(val));
+}
+
+/* integer operand of ldcif/stcfi: general register or 1/2 words */
+static inline word_t FpIntLen(Emu &emu) { return emu.fpu.fpusw.fl ? 4 : 2; }
+
+static void FpDisasmOp(word_t spec, std::ostream &os, bool fp)
+{
+	if (fp && !(spec & 070)) {
+		os << putf("ac%d", spec & 7);
+		return;
+	}
+	AddrOp a;
+	a.init((spec >> 3) & 7, spec & 7);
+	a.Disasm(os);
+}
+
+#define PREF_FP								\
+	auto &fpu = emu.fpu; auto &fps = fpu.fpusw;			\
+	word_t const at = emu.genReg[Emu::REG_PC] - sizeof(word_t);	\
+	uint8_t const ac = (opcode >> 6) & 3;				\
+	(void) fpu; (void) fps; (void) at; (void) ac;
+
+/* DEC order: src, ac / ac, dst; fp is false for integer operands */
+#define DEF_DISASMS_FP_SRC(instr, fp)					\
+DEF_DISASMS(instr) {							\
+	os << " "; FpDisasmOp(opcode & 077, os, fp);			\
+	os << putf(", ac%d", (opcode >> 6) & 3);			\
+}
+#define DEF_DISASMS_FP_DST(instr, fp)					\
+DEF_DISASMS(instr) {							\
+	os << putf(" ac%d, ", (opcode >> 6) & 3);			\
+	FpDisasmOp(opcode & 077, os, fp);				\
+}
+#define DEF_DISASMS_FP_OP(instr, fp)					\
+DEF_DISASMS(instr) { os << " "; FpDisasmOp(opcode & 077, os, fp); }
+
+DEF_EXECUTE(fpu_unknown) {
+	PREF_FP;
+	FpError(emu, Emu::FPU::FEC_OPCODE, true, at);
+}
 DEF_DISASMS(fpu_unknown) { }
 
+DEF_EXECUTE(cfcc) {
+	auto &fps = emu.fpu.fpusw;
+	emu.psw.n = fps.fn;
+	emu.psw.z = fps.fz;
+	emu.psw.v = fps.fv;
+	emu.psw.c = fps.fc;
+}
+DEF_DISASMS(cfcc) { }
+
+DEF_EXECUTE(setf) { emu.fpu.fpusw.fd = 0; }
+DEF_DISASMS(setf) { }
+
 DEF_EXECUTE(setd) { emu.fpu.fpusw.fd = 1; }
 DEF_DISASMS(setd) { }
 
-DEF_EXECUTE(seti) { emu.fpu.fpusw.fl = 1; }
+DEF_EXECUTE(seti) { emu.fpu.fpusw.fl = 0; }
 DEF_DISASMS(seti) { }
 
+DEF_EXECUTE(setl) { emu.fpu.fpusw.fl = 1; }
+DEF_DISASMS(setl) { }
+
+DEF_EXECUTE(ldfps) {
+	PREF_MR_W;
+	op.a.Load(emu, &val);
+	if (!emu.trapPending)
+		emu.fpu.fpusw.raw = val;
+}
+DEF_DISASMS(ldfps) { InstrOp_mr(opcode).Disasm(os); }
+
+DEF_EXECUTE(stfps) {
+	PREF_MR_W;
+	op.a.Store(emu, emu.fpu.fpusw.raw);
+}
+DEF_DISASMS(stfps) { InstrOp_mr(opcode).Disasm(os); }
+
+DEF_EXECUTE(stst) {
+	PREF_FP; FpAddr a;
+	a.Fetch(emu, opcode & 077, 2 * sizeof(word_t));
+	if (a.isReg)
+		emu.genReg[a.reg] = fpu.fec;
+	else
+		FpWriteMem(emu, a, 2 * sizeof(word_t),
+				(uint64_t) fpu.fec << 48 | (uint64_t) fpu.fea << 32);
+}
+DEF_DISASMS(stst) { InstrOp_mr(opcode).Disasm(os); }
+
+/*
+ * Single operand ops: accumulator in host format, memory operand as words,
+ * so D in core keeps all of its bits.
+ */
+#define DEF_FP_SINGLE(instr, hostop, wordop)				\
+DEF_EXECUTE(instr) {							\
+	PREF_FP; FpAddr a; double r; uint64_t m;			\
+	a.Fetch(emu, opcode & 077, FpLen(fps.fd));			\
+	if (emu.trapPending)						\
+		return;							\
+	if (a.isReg) {							\
+		double *acp = FpAc(emu, a, at);				\
+		if (!acp)						\
+			return;						\
+		r = *acp;						\
+		hostop;							\
+		*acp = r;						\
+		FpSetCC(fps, r);					\
+		return;							\
+	}								\
+	m = FpReadMem(emu, a, FpLen(fps.fd));				\
+	if (emu.trapPending || FpUndef(emu, m, at))			\
+		return;							\
+	if (!FpExp(m))							\
+		m = 0;							\
+	wordop;								\
+	FpSetCC(fps, FpToHost(m));					\
+} DEF_DISASMS_FP_OP(instr, true)
+
+DEF_EXECUTE(clrf) {
+	PREF_FP; FpAddr a;
+	a.Fetch(emu, opcode & 077, FpLen(fps.fd));
+	if (emu.trapPending)
+		return;
+	if (a.isReg) {
+		double *acp = FpAc(emu, a, at);
+		if (!acp)
+			return;
+		*acp = 0;
+	} else {
+		FpWriteMem(emu, a, FpLen(fps.fd), 0);
+		if (emu.trapPending)
+			return;
+	}
+	FpSetCC(fps, 0);
+} DEF_DISASMS_FP_OP(clrf, true)
+
+DEF_FP_SINGLE(tstf, (void) r, (void) m)
+DEF_FP_SINGLE(absf, r = fabs(r),
+		m &= ~FP_SIGN; FpWriteMem(emu, a, FpLen(fps.fd), m))
+DEF_FP_SINGLE(negf, r = -r + 0.0,
+		m ^= m ? FP_SIGN : 0; FpWriteMem(emu, a, FpLen(fps.fd), m))
+
+DEF_EXECUTE(ldf) {
+	PREF_FP; double s;
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	fpu.ac[ac] = s;
+	FpSetCC(fps, s);
+}
+DEF_DISASMS_FP_SRC(ldf, true)
+
+DEF_EXECUTE(stf) {
+	PREF_FP;
+	FpDst(emu, opcode & 077, fps.fd, fpu.ac[ac], at);
+}
+DEF_DISASMS_FP_DST(stf, true)
+
+DEF_EXECUTE(cmpf) {
+	PREF_FP; double s;
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	fps.fn = s < fpu.ac[ac];
+	fps.fz = s == fpu.ac[ac];
+	fps.fv = fps.fc = 0;
+}
+DEF_DISASMS_FP_SRC(cmpf, true)
+
+/* error term of r = a + b, Knuth's TwoSum */
+static inline double FpAddErr(double a, double b, double r)
+{
+	double bb = r - a;
+	return (a - (r - bb)) + (b - bb);
+}
+
+DEF_EXECUTE(addf) {
+	PREF_FP; double s, r, d = fpu.ac[ac];
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	r = d + s;
+	FpResult(emu, r, fps.ft ? FpAddErr(d, s, r) : 0, fps.fd, at);
+	fpu.ac[ac] = r;
+}
+DEF_DISASMS_FP_SRC(addf, true)
+
+DEF_EXECUTE(subf) {
+	PREF_FP; double s, r, d = fpu.ac[ac];
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	r = d - s;
+	FpResult(emu, r, fps.ft ? FpAddErr(d, -s, r) : 0, fps.fd, at);
+	fpu.ac[ac] = r;
+}
+DEF_DISASMS_FP_SRC(subf, true)
+
+DEF_EXECUTE(mulf) {
+	PREF_FP; double s, r, d = fpu.ac[ac];
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	r = d * s;
+	FpResult(emu, r, fps.ft ? fma(d, s, -r) : 0, fps.fd, at);
+	fpu.ac[ac] = r;
+}
+DEF_DISASMS_FP_SRC(mulf, true)
+
+DEF_EXECUTE(divf) {
+	PREF_FP; double s, r, d = fpu.ac[ac];
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	if (s == 0) {
+		FpError(emu, Emu::FPU::FEC_DIVZ, true, at);
+		return;
+	}
+	r = d / s;
+	/* d - r * s has the sign of the error times s */
+	double err = fps.ft ? fma(-r, s, d) : 0;
+	FpResult(emu, r, s < 0 ? -err : err, fps.fd, at);
+	fpu.ac[ac] = r;
+}
+DEF_DISASMS_FP_SRC(divf, true)
+
+/* integer part to ac|1 unless ac is odd, fraction to ac */
+DEF_EXECUTE(modf) {
+	PREF_FP; double s, p, ip, frac, d = fpu.ac[ac];
+	if (!FpSrc(emu, opcode & 077, fps.fd, &s, at))
+		return;
+	p = d * s;
+	ip = trunc(p);
+	frac = p - ip;
+	FpResult(emu, ip, 0, fps.fd, at);
+	bool ovf = fps.fv;
+	FpResult(emu, frac, fps.ft ? fma(d, s, -p) : 0, fps.fd, at);
+	fps.fv = fps.fv || ovf;
+	if (!(ac & 1))
+		fpu.ac[ac | 1] = ip;
+	fpu.ac[ac] = frac;
+}
+DEF_DISASMS_FP_SRC(modf, true)
+
+DEF_EXECUTE(ldexp) {
+	PREF_FP; InstrOp_mr op(opcode); word_t val;
+	op.Fetch<word_t>(emu);
+	op.a.Load(emu, &val);
+	if (emu.trapPending)
+		return;
+	/* fraction is kept, 0 has none but the hidden bit */
+	int exp = (s_word_t) val + 0200;
+	uint64_t m = FpFromHost(fpu.ac[ac]) & ~FP_EXP_MASK;
+	double r = FpToHost(m | (uint64_t) (exp & 0377) << FP_FRAC);
+	bool ovf = exp > 0377;
+	if (ovf) {
+		if (!FpError(emu, Emu::FPU::FEC_OVFLO, fps.iv, at))
+			r = 0;
+	} else if (exp < 1) {
+		if (!FpError(emu, Emu::FPU::FEC_UNFLO, fps.iu, at))
+			r = 0;
+	}
+	fpu.ac[ac] = r;
+	FpSetCC(fps, r);
+	fps.fv = ovf;
+}
+DEF_DISASMS_FP_SRC(ldexp, false)
+
+/* stexp and stcfi pass their condition codes on to the CPU */
+static inline void FpCCToCPU(Emu &emu)
+{
+	auto &fps = emu.fpu.fpusw;
+	emu.psw.n = fps.fn;
+	emu.psw.z = fps.fz;
+	emu.psw.v = fps.fv;
+	emu.psw.c = fps.fc;
+}
+
+DEF_EXECUTE(stexp) {
+	PREF_FP; PREF_MR_W;
+	val = (word_t) (FpExp(FpFromHost(fpu.ac[ac])) - 0200);
+	op.a.Store(emu, val);
+	fps.fn = getSign(val);
+	fps.fz = getZ(val);
+	fps.fv = fps.fc = 0;
+	FpCCToCPU(emu);
+}
+DEF_DISASMS_FP_DST(stexp, false)
+
+/* chops toward 0; out of range stores 0 and sets FC */
+DEF_EXECUTE(stcfi) {
+	PREF_FP; FpAddr a; word_t len = FpIntLen(emu);
+	double t = trunc(fpu.ac[ac]);
+	double lim = len == 4 ? 2147483648.0 : 32768.0;
+	bool bad = t >= lim || t < -lim;
+	int32_t v = bad ? 0 : (int32_t) t;
+	a.Fetch(emu, opcode & 077, len);
+	if (emu.trapPending)
+		return;
+	if (a.isReg)
+		emu.genReg[a.reg] = len == 4 ? v >> 16 : v;
+	else
+		FpWriteMem(emu, a, len, (uint64_t) (uint32_t) v << (len == 4 ? 32 : 48));
+	if (emu.trapPending)
+		return;
+	fps.fn = v < 0;
+	fps.fz = v == 0;
+	fps.fv = 0;
+	fps.fc = bad;
+	FpCCToCPU(emu);
+	if (bad)
+		FpError(emu, Emu::FPU::FEC_ICVT, fps.ic, at);
+}
+DEF_DISASMS_FP_DST(stcfi, false)
+
+DEF_EXECUTE(ldcif) {
+	PREF_FP; FpAddr a; word_t len = FpIntLen(emu); int32_t v;
+	a.Fetch(emu, opcode & 077, len);
+	if (emu.trapPending)
+		return;
+	if (a.isReg) {
+		/* register is the high word of a long */
+		v = (s_word_t) emu.genReg[a.reg];
+		if (len == 4)
+			v *= 0x10000;
+	} else {
+		uint64_t m = FpReadMem(emu, a, len);
+		if (emu.trapPending)
+			return;
+		v = len == 4 ? (int32_t) (m >> 32) : (s_word_t) (m >> 48);
+	}
+	double r = v;
+	FpResult(emu, r, 0, fps.fd, at);
+	fpu.ac[ac] = r;
+}
+DEF_DISASMS_FP_SRC(ldcif, false)
+
+/* stcfd/stcdf: ac to the other format */
+DEF_EXECUTE(stcfd) {
+	PREF_FP; double r = fpu.ac[ac];
+	if (!fps.fd) {
+		FpDst(emu, opcode & 077, true, r, at);
+		FpSetCC(fps, r);
+		return;
+	}
+	FpResult(emu, r, 0, false, at);
+	FpDst(emu, opcode & 077, false, r, at);
+}
+DEF_DISASMS_FP_DST(stcfd, true)
+
+/* ldcdf/ldcfd: other format to ac, D rounds to F from all of its bits */
+DEF_EXECUTE(ldcdf) {
+	PREF_FP; FpAddr a; double r;
+	a.Fetch(emu, opcode & 077, FpLen(!fps.fd));
+	if (emu.trapPending)
+		return;
+	if (a.isReg) {
+		double *acp = FpAc(emu, a, at);
+		if (!acp)
+			return;
+		r = *acp;
+	} else {
+		uint64_t m = FpReadMem(emu, a, FpLen(!fps.fd));
+		if (emu.trapPending || FpUndef(emu, m, at))
+			return;
+		if (!fps.fd && FpExp(m)) {
+			uint64_t mag = m & ~FP_SIGN;
+			if (!fps.ft)
+				mag += 1ull << 31;
+			/* rounding past exponent 0377 overflows below */
+			r = (mag & FP_SIGN) ? ldexp(1.0, 0200) :
+				FpToHost(mag & ~0xffffffffull);
+			r = (m & FP_SIGN) ? -r : r;
+		} else
+			r = FpToHost(m);
+	}
+	FpResult(emu, r, 0, fps.fd, at);
+	fpu.ac[ac] = r;
+}
+DEF_DISASMS_FP_SRC(ldcdf, true)
+
 word_t constexpr FPU_ISA_MASK = 0170000;
 
 
@@ -783,18 +1587,451 @@ void Emu::DisasmInstr(word_t opcode, std::ostream &os)
 	}
 }
 
-#ifdef CONF_ENABLE_TRCACHE
 trcache_fn_t Emu::GetTrCacheExecutor(word_t opcode)
 {
+	static trcache_fn_t const sobs[MAX_REG] = {
+		(trcache_fn_t) trsob<0>, (trcache_fn_t) trsob<1>,
+		(trcache_fn_t) trsob<2>, (trcache_fn_t) trsob<3>,
+		(trcache_fn_t) trsob<4>, (trcache_fn_t) trsob<5>,
+		(trcache_fn_t) trsob<6>, (trcache_fn_t) TRWRAPPER_I(sob),
+	};
+	if ((opcode >> 9) == 0077)
+		return sobs[(opcode >> 6) & 7];
 	if ((opcode & FPU_ISA_MASK) == FPU_ISA_MASK) {
 		word_t masked = opcode & ~FPU_ISA_MASK;
-#define I_OP(instr) return TRWRAPPER_I(instr);
+#define I_OP(instr) return (trcache_fn_t) TRWRAPPER_I(instr);
 #include "fpu_isa_switch.h"
 #undef I_OP
 	} else {
-#define I_OP(instr) return TRWRAPPER_I(instr);
+#define I_OP(instr) return (trcache_fn_t) TRWRAPPER_I(instr);
+#include "isa_switch.h"
+#undef I_OP
+	}
+}
+
+trcache_fn_t Emu::GetTrCacheExecutorDyn(word_t opcode)
+{
+	if ((opcode & FPU_ISA_MASK) == FPU_ISA_MASK) {
+		word_t masked = opcode & ~FPU_ISA_MASK;
+#define I_OP(instr) return trwrapper_dyn_##instr;
+#include "fpu_isa_switch.h"
+#undef I_OP
+	} else {
+#define I_OP(instr) return trwrapper_dyn_##instr;
+#include "isa_switch.h"
+#undef I_OP
+	}
+}
+
+/*
+ * Superinstructions: pair runs in one dispatch, each instr still retires
+ * alone, so budget and traps stop exactly between them.
+ * Result is "branch taken" of the second one, as for inline entries.
+ */
+template <void (*A)(word_t, Emu &), void (*B)(word_t, Emu &)>
+static bool trfused()
+{
+	Emu &emu = *Emu::cur;
+	word_t opcode;
+	size_t pos = PtrToTrCache(emu.genReg[Emu::REG_PC]);
+	emu.FetchOpcode(opcode);
+	A(opcode, emu);
+	TRWRAPPER_CHECK(emu, opcode);
+	if (emu.trcache.fn[pos] != (trcache_fn_t) trfused<A, B>) {
+		/* A rewrote B, let its entry translate it again */
+		auto newpc = emu.genReg[Emu::REG_PC];
+		if (emu.engine == Emu::ENGINE_INLINE)
+			frame_retaddr_set(TrCacheEntry(emu.trcache, newpc));
+		return false;
+	}
+	emu.FetchOpcode(opcode);
+	auto oldpc = emu.genReg[Emu::REG_PC];
+	B(opcode, emu);
+	TRWRAPPER_CHECK(emu, opcode);
+	return emu.genReg[Emu::REG_PC] != oldpc;
+}
+
+#define FUSED(a, b) ((trcache_fn_t) trfused<Execute_##a, Execute_##b>)
+
+/* flag producer followed by conditional branch */
+#define FUSE_BCC(a)							\
+	switch (next >> 8) {						\
+	case 0002: return FUSED(a, bne);				\
+	case 0003: return FUSED(a, beq);				\
+	case 0004: return FUSED(a, bge);				\
+	case 0005: return FUSED(a, blt);				\
+	case 0006: return FUSED(a, bgt);				\
+	case 0007: return FUSED(a, ble);				\
+	case 0200: return FUSED(a, bpl);				\
+	case 0201: return FUSED(a, bmi);				\
+	case 0202: return FUSED(a, bhi);				\
+	case 0203: return FUSED(a, blos);				\
+	case 0204: return FUSED(a, bvc);				\
+	case 0205: return FUSED(a, bvs);				\
+	case 0206: return FUSED(a, bcc);				\
+	case 0207: return FUSED(a, bcs);				\
+	}								\
+	return NULL;
+
+/* loop body instr + sob closing it */
+#define FUSE_SOB(a)							\
+	if ((next >> 9) == 0077 && ((next >> 6) & 7) != REG_PC)		\
+		return FUSED(a, sob);
+
+/*
+ * Pairs dominating compiled code: compare/test + branch, loop counter +
+ * branch, register shuffling, body + sob. NULL if opcode and next are not
+ * fusable.
+ */
+trcache_fn_t Emu::GetTrCacheFused(word_t opcode, word_t next)
+{
+	switch (opcode >> 12) {
+	case 002: FUSE_BCC(cmp);
+	case 012: FUSE_BCC(cmpb);
+	case 003: FUSE_BCC(bit);
+	case 013: FUSE_BCC(bitb);
+	case 001:
+		if ((next >> 12) == 001)
+			return FUSED(mov, mov);
+		FUSE_SOB(mov);
+		return NULL;
+	case 011: FUSE_SOB(movb); return NULL;
+	case 006: FUSE_SOB(add); return NULL;
+	case 016: FUSE_SOB(sub); return NULL;
+	}
+	switch (opcode >> 6) {
+	case 00057: FUSE_BCC(tst);
+	case 01057: FUSE_BCC(tstb);
+	case 00052: FUSE_SOB(inc); FUSE_BCC(inc);
+	case 00053: FUSE_SOB(dec); FUSE_BCC(dec);
+	case 00050: FUSE_SOB(clr); return NULL;
+	case 01050: FUSE_SOB(clrb); return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Idioms: block copy, fill and compare loops
+ *	mov (ra)+,(rb)+ / clr (rb)+	cmp (ra)+,(rb)+
+ *	dec rc				bne out
+ *	bne head			dec rc
+ *					bne head
+ * their byte forms and the S forms closed by "sob rc, head" instead of
+ * dec/bne run as one host memmove/memset/memcmp. Registers, flags and
+ * budget end as if the instrs did run. Only plain core is done at once,
+ * rest of loop (io page, unaligned, over loop's own code) goes instr by
+ * instr through body handler A.
+ */
+enum IdiomKind { IDIOM_COPY, IDIOM_FILL, IDIOM_CMP };
+
+template <IdiomKind K, typename T, void (*A)(word_t, Emu &), bool S>
+static void tridiom()
+{
+	Emu &emu = *Emu::cur;
+	auto &tc = emu.trcache;
+	auto &r = emu.genReg;
+	auto &psw = emu.psw;
+	byte_t *mem = emu.coreMem.mem;
+	size_t const memsz = emu.coreMem.sz;
+	word_t pc = r[Emu::REG_PC];
+	word_t const *code = reinterpret_cast<word_t*>(&mem[pc]);
+	word_t const words = (K == IDIOM_CMP ? 4 : 3) - S;
+	word_t ra = (code[0] >> 6) & 7, rb = code[0] & 7;
+	word_t rc = S ? (code[words - 1] >> 6) & 7 : code[words - 2] & 7;
+	word_t a = r[ra], b = r[rb], opcode;
+	uint64_t ni = words; /* instrs per iteration */
+
+	size_t k = r[rc] ? r[rc] : 0x10000;
+	k = std::min<uint64_t>(k, tc.budget / ni);
+	if (sizeof(T) > 1 && ((b | (K == IDIOM_FILL ? 0 : a)) & 1))
+		k = 0;
+	k = std::min(k, b < memsz ? (memsz - b) / sizeof(T) : 0);
+	if (K != IDIOM_FILL)
+		k = std::min(k, a < memsz ? (memsz - a) / sizeof(T) : 0);
+	if (K != IDIOM_CMP && b < pc + words * sizeof(word_t) &&
+			b + k * sizeof(T) > pc)
+		k = b < pc ? (pc - b) / sizeof(T) : 0;
+
+	if (!k) {
+		emu.FetchOpcode(opcode);
+		A(opcode, emu);
+		TRWRAPPER_CHECK(emu, opcode);
+		goto link;
+	}
+
+	T *src, *dst;
+	src = reinterpret_cast<T*>(&mem[a]);
+	dst = reinterpret_cast<T*>(&mem[b]);
+	switch (K) {
+	case IDIOM_COPY:
+		if (b > a && b < a + k * sizeof(T)) /* dst ahead: pattern repeats */
+			for (size_t i = 0; i < k; ++i)
+				dst[i] = src[i];
+		else
+			memmove(dst, src, k * sizeof(T));
+		break;
+	case IDIOM_FILL:
+		memset(dst, 0, k * sizeof(T));
+		psw.c = 0;
+		break;
+	case IDIOM_CMP: {
+		size_t m = 0;
+		if (memcmp(src, dst, k * sizeof(T)))
+			while (src[m] == dst[m])
+				m++;
+		else
+			m = k - 1;
+		T s = src[m], d = dst[m], val = s - d;
+		psw.c = s < d;
+		if (val) { /* bne out taken, rc not decremented */
+			psw.n = getSign(val);
+			psw.z = 0;
+			psw.v = DetectSubOvf(s, d, val);
+			r[ra] += (m + 1) * sizeof(T);
+			r[rb] += (m + 1) * sizeof(T);
+			r[rc] -= m;
+			r[Emu::REG_PC] = pc + 2 * sizeof(word_t) +
+				sizeof(word_t) * (int8_t) code[1];
+			tc.budget -= ni * m + 2;
+			goto done;
+		}
+		break;
+	}
+	}
+	if (K != IDIOM_FILL)
+		r[ra] += k * sizeof(T);
+	r[rb] += k * sizeof(T);
+	r[rc] -= k;
+	if (!S) {
+		psw.n = getSign(r[rc]);
+		psw.z = !r[rc];
+		psw.v = r[rc] == 077777;
+	} else if (K == IDIOM_COPY) {
+		psw.n = getSign(dst[k - 1]);
+		psw.z = getZ(dst[k - 1]);
+		psw.v = 0;
+	} else { /* last clr, or cmp of equal ones */
+		psw.n = psw.v = 0;
+		psw.z = 1;
+	}
+	if (!r[rc])
+		r[Emu::REG_PC] = pc + words * sizeof(word_t);
+	tc.budget -= ni * k;
+	if (K != IDIOM_CMP) {
+		emu.coreMem.Dirty(b, k * sizeof(T));
+		/* stores to translated code */
+		for (size_t i = b / sizeof(word_t);
+				i <= (b + k * sizeof(T) - 1) / sizeof(word_t); ++i)
+			if (tc.cover[i]) {
+				emu.TrCacheInvalidate(b, k * sizeof(T));
+				break;
+			}
+	}
+done:
+	if (!tc.budget)
+		longjmp(tc.restore_buf, 1);
+link:
+	if (emu.engine == Emu::ENGINE_INLINE)
+		*tc.dyn = TrCacheEntry(tc, r[Emu::REG_PC]);
+}
+
+#define IDIOM(k, t, a, s) ((trcache_fn_t) tridiom<k, t, Execute_##a, s>)
+
+trcache_fn_t Emu::GetTrCacheIdiom(word_t const *code, word_t &words)
+{
+	word_t op = code[0];
+	word_t ra = (op >> 6) & 7, rb = op & 7, rc;
+	bool byte = op & 0100000;
+	bool sob = false;
+	/* closing dec rc / bne head, or sob rc, head one word shorter */
+	auto loop = [&](word_t const *tail) {
+		sob = (tail[0] & ~0777) == 077000;
+		if (sob) {
+			words--;
+			rc = (tail[0] >> 6) & 7;
+		} else
+			rc = tail[0] & 7;
+		bool ok = sob ? (tail[0] & 077) == words :
+			(tail[0] & ~7) == 005300 && tail[1] == 001000 + (0400 - words);
+		return ok && rc < REG_SP && rc != rb && rb < REG_SP;
+	};
+
+	if ((op & 077770) == 005020) {
+		words = 3;
+		if (!loop(code + 1))
+			return NULL;
+		if (sob)
+			return byte ? IDIOM(IDIOM_FILL, byte_t, clrb, true) :
+				IDIOM(IDIOM_FILL, word_t, clr, true);
+		return byte ? IDIOM(IDIOM_FILL, byte_t, clrb, false) :
+			IDIOM(IDIOM_FILL, word_t, clr, false);
+	}
+	if (ra >= REG_SP || ra == rb || (op & 07070) != 02020)
+		return NULL;
+	switch (op & 070000) {
+	case 010000:
+		words = 3;
+		if (!loop(code + 1) || rc == ra)
+			return NULL;
+		if (sob)
+			return byte ? IDIOM(IDIOM_COPY, byte_t, movb, true) :
+				IDIOM(IDIOM_COPY, word_t, mov, true);
+		return byte ? IDIOM(IDIOM_COPY, byte_t, movb, false) :
+			IDIOM(IDIOM_COPY, word_t, mov, false);
+	case 020000:
+		/* bne out must leave the loop forward */
+		words = 4;
+		if ((code[1] & ~0177) != 001000 || !loop(code + 2) ||
+				(code[1] & 0177) < words - 2 || rc == ra)
+			return NULL;
+		if (sob)
+			return byte ? IDIOM(IDIOM_CMP, byte_t, cmpb, true) :
+				IDIOM(IDIOM_CMP, word_t, cmp, true);
+		return byte ? IDIOM(IDIOM_CMP, byte_t, cmpb, false) :
+			IDIOM(IDIOM_CMP, word_t, cmp, false);
+	}
+	return NULL;
+}
+
+/*
+ * Direct threaded engine: word of code keeps its handler label and opcode,
+ * each handler dispatches the next instr itself. No code is generated, so
+ * it runs where executable memory is denied. Chunk of entries is decoded
+ * on first run in it, TrCacheInvalidate drops entry back to decode on code
+ * write.
+ */
+void Emu::ThreadedRun(std::ostream &os, uint64_t budget)
+{
+	Emu &emu = *Emu::cur;
+	auto &tc = emu.trcache;
+	auto &pc = emu.genReg[Emu::REG_PC];
+	TrCache::ThrInsn *thr = tc.thr, *cur;
+	word_t opcode, masked;
+	size_t chunk, beg, end;
+	bool share = false;
+
+	tc.budget = budget;
+
+#define THR_NEXT() do {							\
+	if (__builtin_expect(emu.trapPending, 0))			\
+		goto trapped;						\
+	if (!--tc.budget)						\
+		goto out;						\
+	cur = &thr[PtrToTrCache(pc)];					\
+	if (__builtin_expect(pc & 1, 0))				\
+		goto slow;						\
+	if (__builtin_expect(!cur->op, 0))				\
+		goto decode;						\
+	goto *cur->op;							\
+} while (0)
+
+	cur = &thr[PtrToTrCache(pc)];
+	if (pc & 1)
+		goto slow;
+	if (!cur->op)
+		goto decode;
+	goto *cur->op;
+
+	/* handler per instr, labels are taken from the decode switch */
+	if (0) {
+#define I_OP(instr) thr_##instr:					\
+		opcode = cur->opcode;					\
+		emu.AdvancePC();					\
+		EXECUTE_I(instr, opcode, emu);				\
+		THR_NEXT();
+#include "fpu_isa_switch.h"
 #include "isa_switch.h"
 #undef I_OP
 	}
+
+decode:
+	if (pc >= emu.coreMem.sz) /* io page: device read, not cached */
+		goto slow;
+	chunk = PtrToTrCache(pc) / TrCache::CHUNK;
+	beg = PtrToTrCache(pc);
+	end = beg + 1;
+	if (!tc.thrChunk[chunk] && !emu.cov.mode) {
+		/*
+		 * First run in chunk: whole of it, shared with other Emus unless
+		 * this one has hle handlers there. Coverage needs first run of
+		 * every entry, it decodes them one by one.
+		 */
+		tc.thrChunk[chunk] = true;
+		share = !emu.HleIn(chunk * TrCache::CHUNK * sizeof(word_t),
+				(chunk + 1) * TrCache::CHUNK * sizeof(word_t));
+		if (share && ThrShareAttach(emu, chunk))
+			goto *cur->op;
+		beg = chunk * TrCache::CHUNK;
+		end = beg + TrCache::CHUNK;
+	}
+	for (size_t i = beg; i < end; ++i) {
+		TrCache::ThrInsn *d = &thr[i];
+		if (d->op)
+			continue;
+		opcode = *(reinterpret_cast<word_t*>(&emu.coreMem.mem[i * 2]));
+		d->opcode = opcode;
+		if ((opcode & FPU_ISA_MASK) == FPU_ISA_MASK) {
+			masked = opcode & ~FPU_ISA_MASK;
+#define I_OP(instr) { d->op = &&thr_##instr; continue; }
+#include "fpu_isa_switch.h"
+#undef I_OP
+		} else {
+#define I_OP(instr) { d->op = &&thr_##instr; continue; }
+#include "isa_switch.h"
+#undef I_OP
+		}
+	}
+	if (emu.cov.mode) {
+		emu.cov.Mark(beg);
+		if (emu.cov.mode == Coverage::COV_EDGE &&
+				CovIsBranch(thr[beg].opcode) && !emu.cov.EdgesDone(beg))
+			thr[beg].op = &&thr_edge;
+	}
+	for (auto it = emu.hle.lower_bound(beg * 2);
+			it != emu.hle.end() && it->first < end * 2; ++it)
+		thr[PtrToTrCache(it->first)].op = &&thr_hle;
+	if (share)
+		ThrSharePublish(emu, chunk);
+	else /* rewritten code or hle, private */
+		for (size_t i = beg; i < end; ++i)
+			TrCacheCover(tc, i, 1);
+	share = false;
+	goto *cur->op;
+
+thr_hle:
+	opcode = cur->opcode;
+	emu.HleCall();
+	THR_NEXT();
+
+thr_edge: /* interpreted until it went both ways */
+	opcode = cur->opcode;
+	beg = PtrToTrCache(pc);
+	emu.AdvancePC();
+	emu.ExecuteInstr(opcode);
+	if (!emu.trapPending) {
+		emu.cov.MarkEdge(beg, pc != (beg + 1) * sizeof(word_t));
+		if (emu.cov.EdgesDone(beg))
+			emu.TrCacheInvalidate(beg * sizeof(word_t), sizeof(word_t));
+	}
+	THR_NEXT();
+
+slow:
+	emu.FetchOpcode(opcode);
+	if (!emu.trapPending)
+		emu.ExecuteInstr(opcode);
+	THR_NEXT();
+#undef THR_NEXT
+
+out:
+	assert((!tc.budget || emu.waiting) && "stopped with no reason");
+	return;
+trapped:
+	os << "\tTrap raised: ";
+	emu.DumpTrap(emu.trapId, os);
+	os << "\n\t";
+	emu.DumpInstr(opcode, os);
+	os << "\n";
+	emu.DumpReg(os);
+	os << "\n";
+	return;
 }
-#endif
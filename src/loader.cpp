@@ -0,0 +1,334 @@
+#include "loader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void SymTab::Sort()
+{
+	std::stable_sort(syms.begin(), syms.end(),
+		[](Symbol const &a, Symbol const &b) { return a.addr < b.addr; });
+}
+
+Symbol const *SymTab::Lookup(word_t ptr) const
+{
+	auto it = std::upper_bound(syms.begin(), syms.end(), ptr,
+		[](word_t p, Symbol const &s) { return p < s.addr; });
+	if (it == syms.begin())
+		return NULL;
+	return &*(--it);
+}
+
+Symbol const *SymTab::Find(char const *name) const
+{
+	for (auto &s : syms)
+		if (s.name == name)
+			return &s;
+	return NULL;
+}
+
+struct FileMap {
+	int fd = -1;
+	byte_t const *data = NULL;
+	size_t sz = 0;
+
+	int Open(char const *path)
+	{
+		struct stat st;
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return -errno;
+		if (fstat(fd, &st) < 0)
+			return -errno;
+		sz = st.st_size;
+		if (!sz)
+			return 0;
+		void *ptr = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED)
+			return -errno;
+		data = (byte_t const*) ptr;
+		return 0;
+	}
+	~FileMap()
+	{
+		if (data)
+			munmap((void*) data, sz);
+		if (fd >= 0)
+			close(fd);
+	}
+	word_t Word(size_t off) const { return data[off] | (data[off + 1] << 8); }
+};
+
+/* Copy segment to core, map whole pages directly from file if offsets allow */
+static int PlaceSegment(Emu &emu, FileMap &f, size_t off, word_t addr,
+		size_t len, Image &img)
+{
+	auto &core = emu.coreMem;
+	if (off + len > f.sz || (size_t) addr + len > core.sz)
+		return -EINVAL;
+
+	size_t const pg = sysconf(_SC_PAGESIZE);
+	size_t beg = (addr + pg - 1) / pg * pg;
+	size_t end = (addr + len) / pg * pg;
+	if (off % pg == addr % pg && end > beg) {
+		void *ptr = mmap(core.mem + beg, end - beg, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, f.fd, off + (beg - addr));
+		if (ptr != MAP_FAILED) {
+			memcpy(core.mem + addr, f.data + off, beg - addr);
+			memcpy(core.mem + end, f.data + off + (end - addr),
+					addr + len - end);
+			img.mappedPages += (end - beg) / pg;
+			return 0;
+		}
+	}
+	memcpy(core.mem + addr, f.data + off, len);
+	return 0;
+}
+
+/***************************** pdp11-aout *************************************/
+
+struct AoutHdr {
+	enum Magic : word_t {
+		OMAGIC = 0407,	/* text and data contiguous */
+		NMAGIC = 0410,	/* data on next 8K segment */
+		IMAGIC = 0411,	/* separate I/D */
+	};
+	enum SymType : uint8_t {
+		N_EXT  = 001,
+		N_ABS  = 002,
+		N_TEXT = 004,
+		N_DATA = 006,
+		N_BSS  = 010,
+		N_TYPE = 036,
+		N_STAB = 0340,
+	};
+	static constexpr size_t SZ = 8 * sizeof(word_t);
+	static constexpr size_t NLIST_SZ = 8;
+
+	word_t magic, text, data, bss, syms, entry, unused, flag;
+
+	bool Parse(FileMap const &f)
+	{
+		if (f.sz < SZ)
+			return false;
+		word_t *w[] = { &magic, &text, &data, &bss, &syms, &entry,
+			&unused, &flag };
+		for (size_t i = 0; i < 8; ++i)
+			*w[i] = f.Word(i * sizeof(word_t));
+		if (magic != OMAGIC && magic != NMAGIC && magic != IMAGIC)
+			return false;
+		return SZ + text + data <= f.sz;
+	}
+	size_t SymOff() const { return SZ + (text + data) * (flag ? 1 : 2); }
+};
+
+static void AoutReadSyms(FileMap const &f, AoutHdr const &hdr, SymTab &symtab)
+{
+	size_t symoff = hdr.SymOff();
+	size_t stroff = symoff + hdr.syms;
+	if (stroff + 4 > f.sz)
+		return;
+
+	/* string table length, its byte order varies between toolchains */
+	uint32_t lo = f.Word(stroff), hi = f.Word(stroff + 2);
+	size_t strsz = f.sz - stroff;
+	uint32_t cand[] = { lo | (hi << 16), hi | (lo << 16) };
+	for (auto c : cand) {
+		if (c >= 4 && c <= strsz) {
+			strsz = c;
+			break;
+		}
+	}
+	char const *strtab = (char const*) f.data + stroff;
+
+	for (size_t i = 0; i < hdr.syms / AoutHdr::NLIST_SZ; ++i) {
+		size_t e = symoff + i * AoutHdr::NLIST_SZ;
+		word_t strx = f.Word(e + 2);
+		uint8_t type = f.data[e + 4];
+		word_t value = f.Word(e + 6);
+
+		if (type & AoutHdr::N_STAB)
+			continue;
+		switch (type & AoutHdr::N_TYPE) {
+		case AoutHdr::N_ABS:
+		case AoutHdr::N_TEXT:
+		case AoutHdr::N_DATA:
+		case AoutHdr::N_BSS:
+			break;
+		default:
+			continue;
+		}
+		if (strx < 4 || strx >= strsz)
+			continue;
+		size_t len = strnlen(strtab + strx, strsz - strx);
+		symtab.Add(value, type, std::string(strtab + strx, len));
+	}
+	symtab.Sort();
+}
+
+/* Header has no text address: take lowest text symbol (-Ttext) */
+static word_t AoutTextAddr(SymTab const &symtab)
+{
+	word_t text_addr = 0xffff;
+	for (auto &s : symtab.syms)
+		if ((s.type & AoutHdr::N_TYPE) == AoutHdr::N_TEXT)
+			text_addr = std::min(text_addr, s.addr);
+	return text_addr == 0xffff ? 0 : text_addr;
+}
+
+/*
+ * Auto-detection only: header must describe this very file, not just
+ * start with the magic, raw code may begin with br .+020 (0407) too.
+ */
+static bool AoutPlausible(FileMap const &f, AoutHdr const &hdr)
+{
+	if ((hdr.text | hdr.data | hdr.bss | hdr.entry) & 1 || hdr.unused ||
+			hdr.flag > 1 || hdr.syms % AoutHdr::NLIST_SZ)
+		return false;
+	if (hdr.SymOff() + hdr.syms > f.sz || (size_t) hdr.text + hdr.data +
+			hdr.bss > Emu::CoreMemory::sz)
+		return false;
+	SymTab symtab;
+	AoutReadSyms(f, hdr, symtab);
+	word_t text_addr = AoutTextAddr(symtab);
+	return hdr.entry >= text_addr && hdr.entry < text_addr + hdr.text;
+}
+
+static int LoadAout(Emu &emu, FileMap &f, AoutHdr const &hdr, Image &img)
+{
+	int rc;
+	if (hdr.magic == AoutHdr::IMAGIC)
+		return -ENOTSUP; /* no MMU */
+
+	AoutReadSyms(f, hdr, img.symtab);
+	word_t text_addr = AoutTextAddr(img.symtab);
+
+	size_t data_addr = text_addr + hdr.text;
+	if (hdr.magic == AoutHdr::NMAGIC)
+		data_addr = (data_addr + 017777) & ~017777;
+	size_t bss_addr = data_addr + hdr.data;
+	if (bss_addr + hdr.bss > emu.coreMem.sz)
+		return -EFBIG;
+
+	if ((rc = PlaceSegment(emu, f, AoutHdr::SZ, text_addr, hdr.text, img)) < 0)
+		return rc;
+	if ((rc = PlaceSegment(emu, f, AoutHdr::SZ + hdr.text, data_addr,
+					hdr.data, img)) < 0)
+		return rc;
+	memset(emu.coreMem.mem + bss_addr, 0, hdr.bss);
+
+	img.fmt = Image::FMT_AOUT;
+	img.entry = hdr.entry;
+	img.hasEntry = true;
+	return 0;
+}
+
+/************************** Absolute loader ***********************************/
+
+/* Block at pos: 1, 0, byte count, load address, data, checksum */
+static int LdaBlock(FileMap const &f, size_t pos, word_t &bc, word_t &addr)
+{
+	if (pos + 6 > f.sz || f.data[pos] != 1 || f.data[pos + 1])
+		return -EINVAL;
+	bc = f.Word(pos + 2);
+	addr = f.Word(pos + 4);
+	if (bc < 6 || pos + bc + 1 > f.sz)
+		return -EINVAL;
+
+	byte_t sum = 0;
+	for (size_t i = 0; i <= bc; ++i)
+		sum += f.data[pos + i];
+	return sum ? -EBADMSG : 0;
+}
+
+/*
+ * Auto-detection only: every block up to the end one must be well formed,
+ * checksummed and fit core, raw code may begin with wait (000001) too.
+ */
+static bool LdaPlausible(FileMap const &f)
+{
+	word_t bc, addr;
+	for (size_t pos = 0; pos < f.sz; pos += bc + 1) {
+		if (!f.data[pos]) {
+			bc = 0;
+			continue;
+		}
+		if (LdaBlock(f, pos, bc, addr) < 0)
+			return false;
+		if (bc == 6)
+			return true;
+		if ((size_t) addr + bc - 6 > Emu::CoreMemory::sz)
+			return false;
+	}
+	return false;
+}
+
+static int LoadLda(Emu &emu, FileMap &f, Image &img)
+{
+	int rc;
+	size_t pos = 0;
+
+	img.fmt = Image::FMT_LDA;
+	while (pos < f.sz) {
+		if (!f.data[pos]) { /* leader/trailer */
+			pos++;
+			continue;
+		}
+		word_t bc, addr;
+		if ((rc = LdaBlock(f, pos, bc, addr)) < 0)
+			return rc;
+
+		if (bc == 6) {
+			if (!(addr & 1)) {
+				img.entry = addr;
+				img.hasEntry = true;
+			}
+			return 0;
+		}
+		if ((rc = PlaceSegment(emu, f, pos + 6, addr, bc - 6, img)) < 0)
+			return rc;
+		pos += bc + 1;
+	}
+	return 0;
+}
+
+/******************************************************************************/
+
+int LoadImage(Emu &emu, char const *path, Image &img, word_t raw_addr)
+{
+	int rc;
+	FileMap f;
+	if ((rc = f.Open(path)) < 0)
+		return rc;
+
+	AoutHdr hdr;
+	if (img.fmt == Image::FMT_AUTO) {
+		if (hdr.Parse(f) && AoutPlausible(f, hdr))
+			img.fmt = Image::FMT_AOUT;
+		else if (LdaPlausible(f))
+			img.fmt = Image::FMT_LDA;
+		else
+			img.fmt = Image::FMT_RAW;
+	}
+
+	switch (img.fmt) {
+	case Image::FMT_AOUT:
+		if (!hdr.Parse(f))
+			return -ENOEXEC;
+		return LoadAout(emu, f, hdr, img);
+	case Image::FMT_LDA:
+		return LoadLda(emu, f, img);
+	default:
+		if (raw_addr >= emu.coreMem.sz)
+			return -EINVAL;
+		rc = PlaceSegment(emu, f, 0, raw_addr,
+				std::min(f.sz, emu.coreMem.sz - (size_t) raw_addr), img);
+		img.fmt = Image::FMT_RAW;
+		img.entry = raw_addr;
+		img.hasEntry = true;
+		return rc;
+	}
+}
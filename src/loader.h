@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "emu.h"
+
+struct Symbol {
+	word_t addr;
+	uint8_t type;
+	std::string name;
+};
+
+struct SymTab {
+	std::vector<Symbol> syms; /* sorted by addr after Sort() */
+
+	void Add(word_t addr, uint8_t type, std::string const &name)
+	{ syms.push_back(Symbol { addr, type, name }); }
+	void Sort();
+	/* nearest symbol at or below ptr */
+	Symbol const *Lookup(word_t ptr) const;
+	Symbol const *Find(char const *name) const;
+};
+
+struct Image {
+	enum Format : uint8_t {
+		FMT_AUTO,
+		FMT_RAW,	/* objcopy -O binary */
+		FMT_AOUT,	/* pdp11-aout 0407/0410 */
+		FMT_LDA,	/* absolute loader paper tape */
+	};
+	Format fmt = FMT_AUTO;
+	word_t entry = 0;
+	bool hasEntry = false;
+	size_t mappedPages = 0; /* zero-copy mapped, rest is copied */
+	SymTab symtab;
+};
+
+/*
+ * Load file into core memory, returns <0 on error.
+ * raw_addr is the load address for FMT_RAW images.
+ * FMT_AUTO takes a.out if the header describes the file: even sizes,
+ * segments and symbols within it, program fits core and entry lies in
+ * text. Else LDA if the whole tape up to its end block checks out. Else
+ * raw; set fmt when a raw image could pass for one of the others.
+ */
+int LoadImage(Emu &emu, char const *path, Image &img, word_t raw_addr);
@@ -1,8 +1,12 @@
 #include <iostream>
-#include <fstream>
 #include <cstring>
 #include <cassert>
 #include <emu.h>
+#include <blkdev.h>
+#include <loader.h>
+#include <replay.h>
+#include <warm.h>
+#include <fuzz.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -161,11 +165,76 @@ struct DummyVT : public Emu::DevBase {
 int main(int argc, char **argv)
 {
 	word_t const load_addr = 01000;
+	char const *disk_path = NULL;
+	char const *log_path = NULL;
+	char const *warm_dir = NULL;
+	ReplayLog::Mode log_mode = ReplayLog::MODE_RECORD;
+	int hot_threshold = -1;
+	bool no_fuse = false;
+	Coverage::Mode cov_mode = Coverage::COV_OFF;
+	uint64_t fuzz_execs = 0;
+	unsigned fuzz_jobs = 0;
+	Emu::Engine engine = Emu::CONF_ENGINE;
 
-	if (argc != 2) {
-		std::cerr << argv[0] << " <bin>\n";
+	int opt;
+	while ((opt = getopt(argc, argv, "d:r:p:t:Fe:c:C:z:j:")) != -1) {
+		switch (opt) {
+		case 'd':
+			disk_path = optarg;
+			break;
+		case 'r':
+		case 'p':
+			log_path = optarg;
+			log_mode = (opt == 'r') ? ReplayLog::MODE_RECORD :
+				ReplayLog::MODE_REPLAY;
+			break;
+		case 't':
+			hot_threshold = atoi(optarg);
+			if (hot_threshold < 0 || hot_threshold > UINT16_MAX)
+				goto usage;
+			break;
+		case 'F':
+			no_fuse = true;
+			break;
+		case 'c':
+			warm_dir = optarg;
+			break;
+		case 'e':
+			if (!Emu::EngineByName(optarg, &engine))
+				goto usage;
+			break;
+		case 'C':
+			if (!strcmp(optarg, "block"))
+				cov_mode = Coverage::COV_BLOCK;
+			else if (!strcmp(optarg, "edge"))
+				cov_mode = Coverage::COV_EDGE;
+			else
+				goto usage;
+			break;
+		case 'z':
+			fuzz_execs = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			fuzz_jobs = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) {
+usage:
+		std::cerr << argv[0] << " [-d disk.img] [-r|-p log] [-t hot_threshold] [-F]"
+			" [-e dbg|step|loop|inline|threaded] [-c cache_dir]"
+			" [-C block|edge] [-z execs [-j jobs]] <bin>\n";
 		return 1;
 	}
+	if (fuzz_execs) {
+		int rc = FuzzMain(argv[optind], load_addr, engine, fuzz_execs,
+				fuzz_jobs);
+		if (rc < 0)
+			std::cerr << "fuzz failed: " << strerror(-rc) << "\n";
+		return rc < 0;
+	}
 	DummyVT vt;
 	if (vt.Create() < 0) {
 		std::cerr << "vt.Create failed\n";
@@ -176,32 +245,88 @@ int main(int argc, char **argv)
 
 	Emu emu;
 	emu.IOspaceRegister(vt_info);
-	std::ifstream test(argv[1], std::ios::binary);
-	test.read(reinterpret_cast<char*>(emu.coreMem.mem + load_addr),
-			16 * 1024);
-	test.close();
-	emu.genReg[Emu::REG_PC] = load_addr;
-	emu.TrCacheAcquire();
+	if (hot_threshold >= 0)
+		emu.trcache.hotThreshold = hot_threshold;
+	emu.trcache.fuse = !no_fuse;
+	if (emu.SetEngine(engine) < 0) {
+		std::cerr << "engine " << Emu::EngineName(engine) <<
+			" not supported by host\n";
+		return 1;
+	}
+	if (cov_mode)
+		emu.SetCoverage(cov_mode);
+
+	AioEngine *aio = NULL;
+	BlkDev *disk = NULL;
+	if (disk_path) {
+		aio = AioEngine::Create();
+		disk = new BlkDev(aio);
+		if (disk->Open(disk_path) < 0) {
+			std::cerr << "disk.Open failed\n";
+			return 1;
+		}
+		Emu::DevInfo disk_info;
+		disk->getInfo(disk_info);
+		emu.IOspaceRegister(disk_info);
+	}
+
+	Image img;
+	if (LoadImage(emu, argv[optind], img, load_addr) < 0) {
+		std::cerr << "LoadImage failed\n";
+		return 1;
+	}
+	if (!img.hasEntry) {
+		std::cerr << "image has no entry point\n";
+		return 1;
+	}
+	emu.symtab = &img.symtab;
+	emu.genReg[Emu::REG_PC] = img.entry;
+
+	ReplayLog replay;
+	if (log_path) {
+		if (replay.Open(log_path, log_mode) < 0) {
+			std::cerr << "replay.Open failed\n";
+			return 1;
+		}
+		emu.replay = &replay;
+	}
+
+	/* only speeds up start, run goes on without it */
+	WarmCache warm;
+	if (warm_dir && warm.Open(emu, warm_dir) < 0)
+		std::cerr << "warm.Open failed, cache ignored\n";
 
 #ifdef CONF_SHOW_CYCLES
-	size_t nCycles = 0;
-#endif
-#ifdef CONF_ENABLE_TRCACHE_RUN
-	Emu::TrCacheRun(std::cout);
+	uint64_t const slice = 2ull << 20;
 #else
-	while (!emu.trapPending) {
-#ifdef CONF_ENABLE_TRCACHE
-		Emu::TrCacheStep(std::cout);
-#else
-		emu.DbgStep(std::cout);
+	uint64_t const slice = UINT64_MAX;
 #endif
+	while (!emu.trapPending && !emu.waiting) {
+		emu.Run(slice, std::cout);
 #ifdef CONF_SHOW_CYCLES
-		if ((++nCycles) % (2ull << 20) == 0)
-			std::cout << nCycles / (2ull << 20) << "M cycles\n";
+		std::cout << emu.icount / (2ull << 20) << "M cycles\n";
 #endif
-		//char a;
-		//std::cin >> a;
 	}
-#endif
+	if (log_path) {
+		replay.Close();
+		if (replay.diverged)
+			std::cout << "replay diverged at instr " <<
+				replay.divergedAt << "\n";
+	}
+	if (warm_dir && warm.Save(emu) < 0)
+		std::cerr << "warm.Save failed\n";
+	if (cov_mode) {
+		std::cout << "coverage: " << emu.cov.Blocks() << " instrs";
+		if (cov_mode == Coverage::COV_EDGE)
+			std::cout << ", " << emu.cov.Edges() << " branch edges";
+		std::cout << "\n";
+	}
+	if (disk) {
+		disk->Close();
+		std::cout << "disk (" << aio->Name() << "):\n";
+		aio->stats.Dump(std::cout);
+		delete disk;
+		delete aio;
+	}
 	return 0;
 }
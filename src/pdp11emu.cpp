@@ -0,0 +1,252 @@
+#include "pdp11emu.h"
+#include "emu.h"
+#include "loader.h"
+#include "snapshot.h"
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <new>
+
+static_assert(PDP11_ENGINE_THREADED == (int) Emu::ENGINE_THREADED,
+		"pdp11_engine must follow Emu::Engine");
+static_assert(PDP11_PC == (int) Emu::REG_PC,
+		"pdp11_reg must follow Emu::GenRegId");
+
+/* host callbacks behind DevBase */
+struct CDevice : public Emu::DevBase {
+	pdp11_emu *owner;
+	pdp11_device_ops ops;
+	void *ctx;
+
+	CDevice(pdp11_emu *_owner, pdp11_device_ops const &_ops, void *_ctx) :
+		owner(_owner), ops(_ops), ctx(_ctx) { }
+	void Load(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)
+	{
+		if (ops.load)
+			ops.load(ctx, owner, ptr, buf, sz);
+		else
+			emu.RaiseTrap(Emu::TRAP_MME);
+	}
+	void Store(Emu &emu, word_t ptr, byte_t *buf, uint8_t sz)
+	{
+		if (ops.store)
+			ops.store(ctx, owner, ptr, buf, sz);
+		else
+			emu.RaiseTrap(Emu::TRAP_MME);
+	}
+};
+
+struct pdp11_emu {
+	Emu emu;
+	Image img; /* symtab is referenced by emu */
+	std::vector<std::unique_ptr<CDevice>> devs;
+	std::ostream os { NULL }; /* trap reports dropped, see pdp11_trap */
+	bool hasResetPoint = false;
+
+	/* Emu hot line is aligned */
+	static void *operator new(size_t sz) { return Emu::operator new(sz); }
+	static void operator delete(void *ptr) { Emu::operator delete(ptr); }
+};
+
+struct pdp11_snapshot {
+	Snapshot snap;
+};
+
+int pdp11_api_version(void)
+{
+	return PDP11_API_VERSION;
+}
+
+pdp11_emu *pdp11_create(void)
+{
+	try {
+		return new pdp11_emu;
+	} catch (std::bad_alloc const &) {
+		return NULL;
+	}
+}
+
+void pdp11_destroy(pdp11_emu *e)
+{
+	delete e;
+}
+
+int pdp11_set_engine(pdp11_emu *e, enum pdp11_engine engine)
+{
+	if (engine < 0 || engine >= (int) Emu::MAX_ENGINE)
+		return -EINVAL;
+	return e->emu.SetEngine((Emu::Engine) engine);
+}
+
+int pdp11_load_image(pdp11_emu *e, char const *path, uint16_t raw_addr)
+{
+	int rc;
+	auto &emu = e->emu;
+	e->img = Image();
+	if ((rc = LoadImage(emu, path, e->img, raw_addr)) < 0)
+		return rc;
+	/* core changed under translations and last snapshot */
+	emu.coreMem.Dirty(0, emu.coreMem.sz);
+	emu.TrCacheFlush();
+	emu.symtab = &e->img.symtab;
+	if (e->img.hasEntry)
+		emu.genReg[Emu::REG_PC] = e->img.entry;
+	return 0;
+}
+
+uint64_t pdp11_run(pdp11_emu *e, uint64_t max)
+{
+	return e->emu.Run(max, e->os);
+}
+
+enum pdp11_state pdp11_get_state(pdp11_emu *e)
+{
+	if (e->emu.trapPending)
+		return PDP11_TRAPPED;
+	return e->emu.waiting ? PDP11_WAITING : PDP11_RUNNABLE;
+}
+
+void pdp11_resume(pdp11_emu *e)
+{
+	e->emu.waiting = false;
+}
+
+char const *pdp11_trap(pdp11_emu *e, uint16_t *vec)
+{
+	static char const *const nameTab[] = {
+#define DEF_TRAP(name, vec, str) [Emu::TRAP_##name] = str,
+#include "trap_def.h"
+#undef DEF_TRAP
+	};
+	static word_t const vecTab[] = {
+#define DEF_TRAP(name, vec, str) [Emu::TRAP_##name] = vec,
+#include "trap_def.h"
+#undef DEF_TRAP
+	};
+	if (!e->emu.trapPending)
+		return NULL;
+	if (vec)
+		*vec = vecTab[e->emu.trapId];
+	return nameTab[e->emu.trapId];
+}
+
+uint64_t pdp11_icount(pdp11_emu *e)
+{
+	return e->emu.icount;
+}
+
+void pdp11_device_wait(pdp11_emu *e)
+{
+	e->emu.EnterWait();
+}
+
+void pdp11_device_fault(pdp11_emu *e)
+{
+	e->emu.RaiseTrap(Emu::TRAP_MME);
+}
+
+int pdp11_reg_read(pdp11_emu *e, enum pdp11_reg reg, uint16_t *val)
+{
+	if (reg == PDP11_PSW)
+		*val = e->emu.psw.raw;
+	else if (reg >= 0 && reg < (int) Emu::MAX_REG)
+		*val = e->emu.genReg[reg];
+	else
+		return -EINVAL;
+	return 0;
+}
+
+int pdp11_reg_write(pdp11_emu *e, enum pdp11_reg reg, uint16_t val)
+{
+	auto &emu = e->emu;
+	if (reg >= 0 && reg < (int) Emu::MAX_REG) {
+		emu.genReg[reg] = val;
+		return 0;
+	}
+	if (reg != PDP11_PSW)
+		return -EINVAL;
+
+	Emu::PSW psw;
+	psw.raw = val;
+	if (psw.curMode >= Emu::PSW_MODE_MAX)
+		return -EINVAL;
+	/* bank and stack pointer follow, as if PSW was loaded by rti */
+	emu.psw = psw;
+	emu.ChangeRegSet(psw.regSet);
+	emu.ChangeSP((Emu::PSWMode) psw.curMode);
+	return 0;
+}
+
+int pdp11_mem_read(pdp11_emu *e, uint16_t addr, void *buf, size_t len)
+{
+	auto &cm = e->emu.coreMem;
+	if (addr + len > cm.sz)
+		return -EFAULT;
+	memcpy(buf, cm.mem + addr, len);
+	return 0;
+}
+
+int pdp11_mem_write(pdp11_emu *e, uint16_t addr, void const *buf, size_t len)
+{
+	auto &emu = e->emu;
+	auto &cm = emu.coreMem;
+	if (addr + len > cm.sz)
+		return -EFAULT;
+	if (!len)
+		return 0;
+	memcpy(cm.mem + addr, buf, len);
+	cm.Dirty(addr, len);
+	emu.TrCacheInvalidate(addr, len);
+	return 0;
+}
+
+int pdp11_device_register(pdp11_emu *e, uint16_t base, uint16_t len,
+		pdp11_device_ops const *ops, void *ctx)
+{
+	if (!ops || !len || base < Emu::IO_PAGE_BASE ||
+			base + len > 0x10000)
+		return -EINVAL;
+	CDevice *dev = new (std::nothrow) CDevice(e, *ops, ctx);
+	if (!dev)
+		return -ENOMEM;
+	e->devs.emplace_back(dev);
+	Emu::DevInfo info;
+	info.ptr = base;
+	info.len = len;
+	info.dev = dev;
+	e->emu.IOspaceRegister(info);
+	return 0;
+}
+
+void pdp11_set_reset_point(pdp11_emu *e)
+{
+	e->emu.SetResetPoint();
+	e->hasResetPoint = true;
+}
+
+int pdp11_reset(pdp11_emu *e)
+{
+	if (!e->hasResetPoint)
+		return -ENOENT;
+	e->emu.Reset();
+	return 0;
+}
+
+pdp11_snapshot *pdp11_snapshot_take(pdp11_emu *e)
+{
+	pdp11_snapshot *s = new (std::nothrow) pdp11_snapshot;
+	if (s)
+		s->snap.Take(e->emu);
+	return s;
+}
+
+void pdp11_snapshot_restore(pdp11_emu *e, pdp11_snapshot const *s)
+{
+	s->snap.Restore(e->emu);
+}
+
+void pdp11_snapshot_free(pdp11_snapshot *s)
+{
+	delete s;
+}
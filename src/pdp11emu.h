@@ -0,0 +1,114 @@
+#ifndef PDP11EMU_H
+#define PDP11EMU_H
+/*
+ * C API of libpdp11emu, for driving guests in-process from host code.
+ *
+ * One pdp11_emu is one machine, it may be used from one host thread at
+ * a time; independent machines may run in parallel. Functions returning
+ * int give 0 or a negative errno. Link the static library with -lstdc++
+ * -pthread, the shared one exports nothing but the pdp11_ symbols.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PDP11_API_VERSION 1
+#define PDP11_API __attribute__((visibility("default")))
+
+typedef struct pdp11_emu pdp11_emu;
+typedef struct pdp11_snapshot pdp11_snapshot;
+
+enum pdp11_engine {
+	PDP11_ENGINE_DBG,	/* switch interpreter */
+	PDP11_ENGINE_STEP,	/* translation cache, one entry per step */
+	PDP11_ENGINE_LOOP,	/* translation cache in loop */
+	PDP11_ENGINE_INLINE,	/* amd64 code, needs executable memory */
+	PDP11_ENGINE_THREADED,	/* predecoded, no executable memory */
+};
+
+enum pdp11_reg {
+	PDP11_R0, PDP11_R1, PDP11_R2, PDP11_R3, PDP11_R4, PDP11_R5,
+	PDP11_SP, PDP11_PC,
+	PDP11_PSW,
+};
+
+enum pdp11_state {
+	PDP11_RUNNABLE,
+	PDP11_WAITING,	/* wait instr or device stopped it, see pdp11_resume */
+	PDP11_TRAPPED,	/* stopped for good, see pdp11_trap */
+};
+
+/* device registers at base..base+len-1 of the I/O page, ctx is opaque */
+typedef struct pdp11_device_ops {
+	/* off is relative to base, sz is 1 or 2 bytes, little endian */
+	void (*load)(void *ctx, pdp11_emu *emu, uint16_t off, uint8_t *buf,
+			uint8_t sz);
+	void (*store)(void *ctx, pdp11_emu *emu, uint16_t off,
+			uint8_t const *buf, uint8_t sz);
+} pdp11_device_ops;
+
+PDP11_API int pdp11_api_version(void);
+
+/* NULL on failure, engine is the built-in default */
+PDP11_API pdp11_emu *pdp11_create(void);
+PDP11_API void pdp11_destroy(pdp11_emu *emu);
+/* between runs only, translations are dropped */
+PDP11_API int pdp11_set_engine(pdp11_emu *emu, enum pdp11_engine engine);
+
+/*
+ * a.out, absolute loader or raw image; raw_addr is where raw ones go.
+ * PC is set to the image entry, symbols are kept for the machine life.
+ */
+PDP11_API int pdp11_load_image(pdp11_emu *emu, char const *path,
+		uint16_t raw_addr);
+
+/* at most max instrs, returns retired ones; stops early on wait or trap */
+PDP11_API uint64_t pdp11_run(pdp11_emu *emu, uint64_t max);
+PDP11_API enum pdp11_state pdp11_get_state(pdp11_emu *emu);
+/* runnable again after wait, e.g. once device has input */
+PDP11_API void pdp11_resume(pdp11_emu *emu);
+/* name of trap stopped at, NULL if none; vec gets its vector */
+PDP11_API char const *pdp11_trap(pdp11_emu *emu, uint16_t *vec);
+/* instrs retired since create */
+PDP11_API uint64_t pdp11_icount(pdp11_emu *emu);
+
+/* from device callbacks: stop after current instr / fail the access */
+PDP11_API void pdp11_device_wait(pdp11_emu *emu);
+PDP11_API void pdp11_device_fault(pdp11_emu *emu);
+
+PDP11_API int pdp11_reg_read(pdp11_emu *emu, enum pdp11_reg reg,
+		uint16_t *val);
+PDP11_API int pdp11_reg_write(pdp11_emu *emu, enum pdp11_reg reg,
+		uint16_t val);
+/* core memory only, the I/O page is reached by guest code */
+PDP11_API int pdp11_mem_read(pdp11_emu *emu, uint16_t addr, void *buf,
+		size_t len);
+PDP11_API int pdp11_mem_write(pdp11_emu *emu, uint16_t addr,
+		void const *buf, size_t len);
+
+/* ops is copied, ctx must outlive the machine */
+PDP11_API int pdp11_device_register(pdp11_emu *emu, uint16_t base,
+		uint16_t len, pdp11_device_ops const *ops, void *ctx);
+
+/*
+ * Batch runs of one program: set reset point once image is loaded and
+ * devices registered, reset before each run. Only dirty core pages are
+ * rewound, devices are reset, translations of untouched code are kept.
+ * Reset fails with -ENOENT if there is no reset point.
+ */
+PDP11_API void pdp11_set_reset_point(pdp11_emu *emu);
+PDP11_API int pdp11_reset(pdp11_emu *emu);
+
+/* CPU and core; devices are not saved, their owner resets them */
+PDP11_API pdp11_snapshot *pdp11_snapshot_take(pdp11_emu *emu);
+PDP11_API void pdp11_snapshot_restore(pdp11_emu *emu,
+		pdp11_snapshot const *snap);
+PDP11_API void pdp11_snapshot_free(pdp11_snapshot *snap);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,215 @@
+#include "replay.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+int ReplayLog::Open(char const *path, Mode _mode)
+{
+	mode = _mode;
+	if (mode == MODE_RECORD) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		if (fd < 0)
+			return -errno;
+		for (int i = 0; i < 4; ++i)
+			Put(MAGIC >> (8 * i));
+		return 0;
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -errno;
+	uint32_t magic = 0;
+	for (int i = 0; i < 4; ++i) {
+		byte_t b;
+		if (!Get(&b))
+			return -EINVAL;
+		magic |= (uint32_t) b << (8 * i);
+	}
+	if (magic != MAGIC)
+		return -EINVAL;
+	return 0;
+}
+
+int ReplayLog::Close()
+{
+	int rc = 0;
+	if (fd == -1)
+		return 0;
+	if (mode == MODE_RECORD) {
+		if (repeat)
+			Emit(pending, repeat);
+		repeat = 0;
+		rc = Flush();
+	}
+	if (close(fd) < 0 && !rc)
+		rc = -errno;
+	fd = -1;
+	return rc;
+}
+
+int ReplayLog::Flush()
+{
+	size_t off = 0;
+	while (off < pos) {
+		ssize_t rc = write(fd, buf + off, pos - off);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		off += rc;
+	}
+	pos = 0;
+	return 0;
+}
+
+/********************************* Record *************************************/
+
+void ReplayLog::Put(byte_t b)
+{
+	buf[pos++] = b;
+	if (pos == BUF_SZ)
+		Flush();
+}
+
+void ReplayLog::PutVarint(uint64_t v)
+{
+	while (v >= 0x80) {
+		Put(v | 0x80);
+		v >>= 7;
+	}
+	Put(v);
+}
+
+void ReplayLog::Emit(Event const &e, uint64_t n)
+{
+	byte_t tag = 0;
+	if (e.sz == sizeof(word_t))
+		tag |= TAG_WORD;
+	if (e.ptr != lastPtr)
+		tag |= TAG_PTR;
+	if (n > 1)
+		tag |= TAG_REPEAT;
+	if (e.trap)
+		tag |= TAG_TRAP;
+
+	Put(tag);
+	PutVarint(e.delta);
+	if (tag & TAG_PTR) {
+		Put(e.ptr);
+		Put(e.ptr >> 8);
+		lastPtr = e.ptr;
+	}
+	Put(e.val);
+	if (tag & TAG_WORD)
+		Put(e.val >> 8);
+	if (tag & TAG_REPEAT)
+		PutVarint(n - 1);
+}
+
+void ReplayLog::Record(uint64_t icount, word_t ptr, byte_t const *data,
+		uint8_t sz, bool trap)
+{
+	Event e;
+	e.delta = icount - lastCount;
+	e.ptr = ptr;
+	e.val = 0;
+	memcpy(&e.val, data, sz);
+	e.sz = sz;
+	e.trap = trap;
+	lastCount = icount;
+	nEvents++;
+
+	if (repeat && e == pending) {
+		repeat++;
+		return;
+	}
+	if (repeat)
+		Emit(pending, repeat);
+	pending = e;
+	repeat = 1;
+}
+
+/********************************* Replay *************************************/
+
+bool ReplayLog::Get(byte_t *b)
+{
+	if (pos == len) {
+		ssize_t rc;
+		do {
+			rc = read(fd, buf, BUF_SZ);
+		} while (rc < 0 && errno == EINTR);
+		if (rc <= 0)
+			return false;
+		len = rc;
+		pos = 0;
+	}
+	*b = buf[pos++];
+	return true;
+}
+
+bool ReplayLog::GetVarint(uint64_t *v)
+{
+	byte_t b;
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (!Get(&b))
+			return false;
+		*v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool ReplayLog::Next()
+{
+	byte_t tag, lo, hi = 0;
+	if (!Get(&tag))
+		return false;
+	if (tag & ~(TAG_WORD | TAG_PTR | TAG_REPEAT | TAG_TRAP))
+		return false;
+	if (!GetVarint(&pending.delta))
+		return false;
+	if (tag & TAG_PTR) {
+		if (!Get(&lo) || !Get(&hi))
+			return false;
+		lastPtr = lo | (hi << 8);
+	}
+	pending.ptr = lastPtr;
+	pending.sz = (tag & TAG_WORD) ? sizeof(word_t) : sizeof(byte_t);
+	pending.trap = tag & TAG_TRAP;
+	hi = 0;
+	if (!Get(&lo) || ((tag & TAG_WORD) && !Get(&hi)))
+		return false;
+	pending.val = lo | (hi << 8);
+	repeat = 1;
+	if (tag & TAG_REPEAT) {
+		if (!GetVarint(&repeat))
+			return false;
+		repeat++;
+	}
+	return true;
+}
+
+bool ReplayLog::Replay(uint64_t icount, word_t ptr, byte_t *data, uint8_t sz,
+		bool *trap)
+{
+	if (diverged)
+		return false;
+	if (!repeat && !Next()) /* log is over, go live */
+		return false;
+	if (icount - lastCount != pending.delta || ptr != pending.ptr ||
+			sz != pending.sz) {
+		diverged = true;
+		divergedAt = icount;
+		return false;
+	}
+	memcpy(data, &pending.val, sz);
+	*trap = pending.trap;
+	lastCount = icount;
+	repeat--;
+	nEvents++;
+	return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include "emu.h"
+
+/*
+ * Record/replay of nondeterministic guest inputs.
+ * Every device register read is logged with the instruction count it
+ * happened at. In replay mode devices are not asked, logged values are
+ * returned instead and the count is checked to catch divergence.
+ *
+ * Log is append-only: header, then records
+ *   tag, varint icount delta, [ptr], value, [varint repeat]
+ * identical consecutive reads (polling loops) collapse into one record.
+ */
+struct ReplayLog {
+	enum Mode : uint8_t {
+		MODE_RECORD,
+		MODE_REPLAY,
+	};
+	enum Tag : uint8_t {
+		TAG_WORD   = 0x01,	/* else byte access */
+		TAG_PTR    = 0x02,	/* ptr differs from previous record */
+		TAG_REPEAT = 0x04,
+		TAG_TRAP   = 0x08,	/* device raised a trap */
+	};
+
+	Mode mode;
+	bool diverged = false;	/* replay mismatch, went live */
+	uint64_t divergedAt = 0;
+	uint64_t nEvents = 0;
+
+	~ReplayLog() { Close(); }
+	int Open(char const *path, Mode _mode);
+	int Close();
+	int Flush();
+
+	void Record(uint64_t icount, word_t ptr, byte_t const *buf, uint8_t sz,
+			bool trap);
+	/* false if log has nothing matching, caller must go live */
+	bool Replay(uint64_t icount, word_t ptr, byte_t *buf, uint8_t sz,
+			bool *trap);
+
+private:
+	struct Event {
+		uint64_t delta;
+		word_t ptr;
+		word_t val;
+		uint8_t sz;
+		bool trap;
+		bool operator==(Event const &e) const
+		{
+			return delta == e.delta && ptr == e.ptr && val == e.val &&
+				sz == e.sz && trap == e.trap;
+		}
+	};
+	static constexpr size_t BUF_SZ = 64 * 1024;
+	static constexpr uint32_t MAGIC = 0x52313150; /* "P11R" */
+
+	int fd = -1;
+	byte_t buf[BUF_SZ];
+	size_t pos = 0, len = 0;
+	uint64_t lastCount = 0;
+	word_t lastPtr = 0;
+	Event pending;
+	uint64_t repeat = 0; /* record: pending count, replay: left */
+
+	void Emit(Event const &e, uint64_t n);
+	void Put(byte_t b);
+	void PutVarint(uint64_t v);
+	bool Get(byte_t *b);
+	bool GetVarint(uint64_t *v);
+	bool Next();
+};
@@ -0,0 +1,188 @@
+#include "scheduler.h"
+#include <time.h>
+
+uint64_t Scheduler::Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Scheduler::Scheduler(unsigned nWorkers, uint64_t _quantum) : quantum(_quantum)
+{
+	if (!nWorkers)
+		nWorkers = std::thread::hardware_concurrency();
+	if (!nWorkers)
+		nWorkers = 1;
+	for (unsigned i = 0; i < nWorkers; ++i)
+		workers.push_back(new Worker);
+}
+
+Scheduler::~Scheduler()
+{
+	Stop();
+	for (auto w : workers) {
+		if (w->thread.joinable())
+			w->thread.join();
+		delete w;
+	}
+}
+
+void Scheduler::Enqueue(Guest *g, unsigned w)
+{
+	{
+		std::lock_guard<std::mutex> lock(workers[w]->mtx);
+		workers[w]->rq.push_back(g);
+	}
+	if (nReady.fetch_add(1) < workers.size()) {
+		std::lock_guard<std::mutex> lock(idleMtx);
+		idleCv.notify_one();
+	}
+}
+
+Guest *Scheduler::Grab(unsigned w)
+{
+	unsigned n = workers.size();
+	for (unsigned i = 0; i < n; ++i) {
+		Worker *v = workers[(w + i) % n];
+		std::lock_guard<std::mutex> lock(v->mtx);
+		if (v->rq.empty())
+			continue;
+		Guest *g;
+		if (!i) {
+			g = v->rq.front();
+			v->rq.pop_front();
+		} else { /* steal the coldest one */
+			g = v->rq.back();
+			v->rq.pop_back();
+		}
+		nReady.fetch_sub(1);
+		return g;
+	}
+	return NULL;
+}
+
+void Scheduler::Add(Guest *g)
+{
+	nGuests.fetch_add(1);
+	g->state.store(Guest::GUEST_READY);
+	Enqueue(g, nextWorker.fetch_add(1) % workers.size());
+}
+
+void Scheduler::Unpark(Guest *g)
+{
+	Guest::State s = Guest::GUEST_PARKED;
+	if (!g->state.compare_exchange_strong(s, Guest::GUEST_READY))
+		return;
+	g->wakePending.store(false);
+	g->wakeAt.store(0);
+	g->emu->waiting = false;
+	Enqueue(g, nextWorker.fetch_add(1) % workers.size());
+}
+
+void Scheduler::Wake(Guest *g)
+{
+	g->wakePending.store(true);
+	Unpark(g);
+}
+
+void Scheduler::Park(Guest *g, uint64_t deadline)
+{
+	g->wakeAt.store(deadline);
+	g->emu->EnterWait();
+}
+
+void Scheduler::FireTimers()
+{
+	std::vector<Guest*> due;
+	{
+		std::lock_guard<std::mutex> lock(idleMtx);
+		if (timers.empty())
+			return;
+		uint64_t now = Now();
+		while (!timers.empty() && timers.top().at <= now) {
+			Timer t = timers.top();
+			timers.pop();
+			if (t.g->wakeAt.load() == t.at)
+				due.push_back(t.g);
+		}
+	}
+	for (auto g : due)
+		Unpark(g);
+}
+
+void Scheduler::RunQuantum(Guest *g, unsigned w)
+{
+	Emu &emu = *g->emu;
+	g->state.store(Guest::GUEST_RUNNING);
+	emu.Run(quantum, *g->os);
+	g->nQuanta++;
+
+	if (emu.trapPending) {
+		g->state.store(Guest::GUEST_DONE);
+		if (onExit)
+			onExit(g);
+		if (nDone.fetch_add(1) + 1 == nGuests.load()) {
+			std::lock_guard<std::mutex> lock(idleMtx);
+			idleCv.notify_all();
+		}
+		return;
+	}
+	if (emu.waiting) {
+		uint64_t at = g->wakeAt.load();
+		if (at) {
+			std::lock_guard<std::mutex> lock(idleMtx);
+			timers.push(Timer { at, g });
+		}
+		g->state.store(Guest::GUEST_PARKED);
+		if (g->wakePending.load()) /* raced with Wake() */
+			Unpark(g);
+		return;
+	}
+	g->state.store(Guest::GUEST_READY);
+	Enqueue(g, w);
+}
+
+void Scheduler::WorkerLoop(unsigned w)
+{
+	while (!stop.load()) {
+		FireTimers();
+		Guest *g = Grab(w);
+		if (g) {
+			RunQuantum(g, w);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(idleMtx);
+		if (nDone.load() == nGuests.load())
+			break;
+		/* in ns: ms would round a deadline under 1 ms to a busy spin */
+		std::chrono::nanoseconds timeout = std::chrono::milliseconds(10);
+		if (!timers.empty()) {
+			uint64_t now = Now(), at = timers.top().at;
+			timeout = std::chrono::nanoseconds(at > now ? at - now : 0);
+		}
+		idleCv.wait_for(lock, timeout, [this] {
+			return stop.load() || nReady.load() ||
+				nDone.load() == nGuests.load();
+		});
+	}
+	std::lock_guard<std::mutex> lock(idleMtx);
+	idleCv.notify_all();
+}
+
+void Scheduler::Run()
+{
+	stop.store(false);
+	for (unsigned i = 0; i < workers.size(); ++i)
+		workers[i]->thread = std::thread(&Scheduler::WorkerLoop, this, i);
+	for (auto w : workers)
+		w->thread.join();
+}
+
+void Scheduler::Stop()
+{
+	stop.store(true);
+	std::lock_guard<std::mutex> lock(idleMtx);
+	idleCv.notify_all();
+}
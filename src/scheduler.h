@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <queue>
+#include <iostream>
+#include "emu.h"
+
+/*
+ * Time-slices many Emu instances over a fixed pool of host threads.
+ * Each worker owns a run queue and steals from the others when it runs dry.
+ * Guests that executed wait or were parked with a deadline are kept off the
+ * run queues until Wake() or the deadline.
+ */
+struct Guest {
+	enum State : uint8_t {
+		GUEST_READY,
+		GUEST_RUNNING,
+		GUEST_PARKED,
+		GUEST_DONE,
+	};
+	Emu *emu;
+	std::ostream *os;	/* trap reports */
+	void *ctx;		/* owner data */
+	uint64_t nQuanta = 0;
+
+	Guest(Emu *_emu, std::ostream *_os = &std::cerr, void *_ctx = NULL) :
+		emu(_emu), os(_os), ctx(_ctx) { }
+
+	State getState() { return state.load(); }
+private:
+	friend struct Scheduler;
+	std::atomic<State> state { GUEST_READY };
+	std::atomic<bool> wakePending { false };
+	std::atomic<uint64_t> wakeAt { 0 }; /* Scheduler::Now(), 0 - none */
+};
+
+struct Scheduler {
+	static constexpr uint64_t DEFAULT_QUANTUM = 100000;
+
+	/* nWorkers = 0 - one per host cpu */
+	Scheduler(unsigned nWorkers = 0, uint64_t quantum = DEFAULT_QUANTUM);
+	~Scheduler();
+
+	/* called on worker thread when guest trapped */
+	void (*onExit)(Guest *g) = NULL;
+
+	void Add(Guest *g);
+	/* any thread: parked guest becomes runnable */
+	void Wake(Guest *g);
+	/* from device code on guest's own thread: stop and sleep until deadline */
+	void Park(Guest *g, uint64_t deadline);
+	/* blocks until every added guest is done or Stop() */
+	void Run();
+	void Stop();
+
+	static uint64_t Now(); /* ns, monotonic */
+
+private:
+	struct Worker {
+		std::mutex mtx;
+		std::deque<Guest*> rq;
+		std::thread thread;
+	};
+	struct Timer {
+		uint64_t at;
+		Guest *g;
+		bool operator<(Timer const &t) const { return at > t.at; }
+	};
+
+	uint64_t quantum;
+	std::vector<Worker*> workers;
+	std::atomic<unsigned> nextWorker { 0 };
+	std::atomic<size_t> nGuests { 0 };
+	std::atomic<size_t> nDone { 0 };
+	std::atomic<bool> stop { false };
+
+	std::mutex idleMtx;
+	std::condition_variable idleCv;
+	std::priority_queue<Timer> timers; /* under idleMtx */
+
+	std::atomic<size_t> nReady { 0 };
+
+	void Enqueue(Guest *g, unsigned w);
+	void Unpark(Guest *g);
+	Guest *Grab(unsigned w);
+	void FireTimers();
+	void WorkerLoop(unsigned w);
+	void RunQuantum(Guest *g, unsigned w);
+};
@@ -0,0 +1,74 @@
+#include "snapshot.h"
+
+#include <cstring>
+
+static uint64_t snapGen; /* process wide, Emus may swap snapshots */
+
+void Snapshot::Take(Emu &emu)
+{
+	auto &cm = emu.coreMem;
+	fpu = emu.fpu;
+	genReg = emu.genReg;
+	regBanks = emu.regBanks;
+	psw = emu.psw;
+	trapId = emu.trapId;
+	trapVec = emu.trapVec;
+	trapPending = emu.trapPending;
+	waiting = emu.waiting;
+	icount = emu.icount;
+	core.assign(cm.mem, cm.mem + cm.sz);
+	memset(cm.dirty, 0, cm.sz / Emu::CoreMemory::PAGE);
+	emu.snapGen = gen = __atomic_add_fetch(&snapGen, 1, __ATOMIC_RELAXED);
+}
+
+void Snapshot::Restore(Emu &emu) const
+{
+	auto &cm = emu.coreMem;
+	auto const PAGE = Emu::CoreMemory::PAGE;
+	bool all = emu.snapGen != gen;
+	assert(gen && "snapshot was never taken");
+
+	for (size_t p = 0; p < cm.sz / PAGE; ++p) {
+		if (!all && !cm.dirty[p])
+			continue;
+		cm.dirty[p] = false;
+		word_t *cur = reinterpret_cast<word_t*>(cm.mem + p * PAGE);
+		word_t const *old = reinterpret_cast<word_t const*>(&core[p * PAGE]);
+		size_t base = p * PAGE / sizeof(word_t);
+		for (size_t i = 0; i < PAGE / sizeof(word_t); ++i) {
+			if (cur[i] == old[i])
+				continue;
+			cur[i] = old[i];
+			/* code run from there was translated from other words */
+			if (emu.trcache.cover[base + i])
+				emu.TrCacheInvalidate((base + i) * sizeof(word_t),
+						sizeof(word_t));
+		}
+	}
+	emu.fpu = fpu;
+	emu.genReg = genReg;
+	emu.regBanks = regBanks;
+	emu.psw = psw;
+	emu.trapId = trapId;
+	emu.trapVec = trapVec;
+	emu.trapPending = trapPending;
+	emu.waiting = waiting;
+	emu.icount = icount;
+	emu.snapGen = gen;
+}
+
+void Emu::SetResetPoint()
+{
+	if (!resetPoint)
+		resetPoint = new Snapshot;
+	resetPoint->Take(*this);
+}
+
+void Emu::Reset()
+{
+	assert(resetPoint && "SetResetPoint() was never called");
+	/* device DMA may still land in core, it has to be rewound too */
+	for (auto &d : devices)
+		d.dev->Reset(*this);
+	resetPoint->Restore(*this);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <vector>
+#include "emu.h"
+
+/*
+ * Guest CPU state and core at one point of run.
+ * Core writes mark their page dirty, Restore() copies back only those,
+ * so rewinding a short run costs microseconds. Translations are kept but
+ * for restored pages holding translated code. Dirty pages are relative to
+ * the snapshot last taken or restored, any other one is restored whole.
+ * Devices are not saved, their owner resets them.
+ */
+struct Snapshot {
+	void Take(Emu &emu);
+	void Restore(Emu &emu) const;
+
+private:
+	Emu::FPU fpu;
+	Emu::GenRegFile genReg;
+	Emu::GenRegBanks regBanks;
+	Emu::PSW psw;
+	Emu::TrapId trapId;
+	Emu::TrapVec trapVec;
+	bool trapPending;
+	bool waiting;
+	uint64_t icount;
+	std::vector<byte_t> core;
+	uint64_t gen = 0;
+};
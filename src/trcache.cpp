@@ -4,92 +4,811 @@
 #include <cinttypes>
 #include "common.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include "trcache.h"
 
-void *xexec_alloc(size_t sz) {
-	void *ptr = mmap(NULL, sz + sizeof(size_t), PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+static constexpr size_t HUGE_SZ = 2 << 20;
+
+static size_t RoundUp(size_t sz, size_t align)
+{
+	return (sz + align - 1) / align * align;
+}
+
+/*
+ * W^X code memory: memfd mapped twice, code is patched through the RW view
+ * and runs from the exec one. Offsets are the same in both, so rel32
+ * operands don't depend on where the exec view is. It is mapped on demand
+ * only, hosts may deny executable memory. Both views keep the memory,
+ * the fd is closed at once: thousands of Emus don't hold thousands of fds.
+ * Huge pages if host has them reserved, else transparent ones are asked.
+ */
+static int MemfdMap(size_t sz, byte_t **rwp, byte_t **xp, size_t *szp)
+{
+	unsigned const flags[] = { MFD_CLOEXEC | MFD_HUGETLB, MFD_CLOEXEC };
+	int rc = -ENOMEM;
+	for (auto f : flags) {
+		size_t len = (f & MFD_HUGETLB) ? RoundUp(sz, HUGE_SZ) : sz;
+		void *rw = MAP_FAILED, *x = MAP_FAILED;
+		int fd = memfd_create("trcache", f);
+		if (fd < 0) {
+			rc = -errno;
+			continue;
+		}
+		if (!ftruncate(fd, len))
+			rw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					fd, 0);
+		if (rw != MAP_FAILED)
+			x = mmap(NULL, len, PROT_READ | PROT_EXEC, MAP_SHARED,
+					fd, 0);
+		rc = -errno;
+		close(fd);
+		if (x == MAP_FAILED) {
+			if (rw != MAP_FAILED)
+				munmap(rw, len);
+			continue;
+		}
+		if (!(f & MFD_HUGETLB))
+			madvise(rw, len, MADV_HUGEPAGE);
+		*rwp = (byte_t*) rw;
+		*xp = (byte_t*) x;
+		*szp = len;
+		return 0;
+	}
+	return rc;
+}
+
+/* Populated by use only, untouched pages cost nothing. Replaces at */
+static byte_t *LazyMap(size_t sz, void *at = NULL)
+{
+	void *ptr = mmap(at, sz, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE |
+			(at ? MAP_FIXED : 0), -1, 0);
 	if (ptr == MAP_FAILED)
-		abort();
-	size_t *mem = (size_t*) ptr;
-	*(mem++) = (size_t) sz;
-	return mem;
+		throw std::bad_alloc();
+	madvise(ptr, sz, MADV_HUGEPAGE);
+	return (byte_t*) ptr;
 }
 
-void xexec_free(void *ptr) {
-	size_t *mem = (size_t*) ptr;
-	size_t sz = *(--mem);
-	if (munmap(mem, sz + sizeof(size_t)) < 0)
-		abort();
+__thread Emu *Emu::cur;
+
+/* p is address code runs at, bytes are stored through the RW view */
+struct CodeGen {
+	uint8_t *p;
+	ptrdiff_t wdelta;
+
+	void B(uint8_t b) { p[wdelta] = b; p++; }
+	void Rel32(void const *dst)
+	{
+		int32_t rel = (uint8_t const*) dst - (p + sizeof(rel));
+		memcpy(p + wdelta, &rel, sizeof(rel));
+		p += sizeof(rel);
+	}
+	/* slot is a data pointer (RW view) */
+	void CallMem(void const *slot) { B(0xff); B(0x15); Rel32(X(slot)); }
+	void JmpMem(void const *slot)  { B(0xff); B(0x25); Rel32(X(slot)); }
+	void const *X(void const *slot)
+	{
+		return (uint8_t const*) slot - wdelta;
+	}
+	void Jmp(void const *dst)      { B(0xe9); Rel32(dst); }
+	void Jnz(void const *dst)      { B(0x0f); B(0x85); Rel32(dst); }
+	void JmpShort(void const *dst)
+	{
+		B(0xeb);
+		B((uint8_t const*) dst - (p + 1));
+	}
+	void Nop(uint8_t const *end)
+	{
+		static uint8_t const nops[][8] = {
+			{ 0x90 },
+			{ 0x66, 0x90 },
+			{ 0x0f, 0x1f, 0x00 },
+			{ 0x0f, 0x1f, 0x40, 0x00 },
+			{ 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+			{ 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+			{ 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+			{ 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		};
+		while (p < end) {
+			size_t n = std::min<size_t>(end - p, 8);
+			memcpy(p + wdelta, nops[n - 1], n);
+			p += n;
+		}
+	}
+};
+
+/* How entry passes control to the successor, see trcache_entry */
+enum TrLinkKind : uint8_t {
+	LINK_NEXT,
+	LINK_JUMP,
+	LINK_BRANCH,
+	LINK_CALL,
+	LINK_RET,
+	LINK_DYN,
+};
+
+struct TrLink {
+	TrLinkKind kind;
+	word_t next;	/* pc after instr and its operand words */
+	word_t target;	/* jump/branch destination */
+};
+
+/* Words operand (mode:reg) occupies after opcode */
+static inline word_t OperandWords(word_t mr)
+{
+	uint8_t mode = (mr >> 3) & 7, reg = mr & 7;
+	return mode >= 6 || (reg == Emu::REG_PC && (mode == 2 || mode == 3));
+}
+
+/* Operand may move pc somewhere else than next instr */
+static inline bool OperandMovesPC(word_t mr)
+{
+	uint8_t mode = (mr >> 3) & 7, reg = mr & 7;
+	return reg == Emu::REG_PC && (mode == 0 || mode == 4 || mode == 5);
+}
+
+/* Static control flow of instr at pc, anything unsure is LINK_DYN */
+static void TrCacheClassify(Emu &emu, word_t pc, word_t op, TrLink &l)
+{
+	l.kind = LINK_NEXT;
+	l.next = pc + sizeof(word_t);
+	l.target = 0;
+
+	uint8_t top = op >> 12;
+	if ((top & 7) != 0 && (top & 7) != 7) { /* double operand */
+		word_t src = (op >> 6) & 077, dst = op & 077;
+		l.next += sizeof(word_t) * (OperandWords(src) + OperandWords(dst));
+		if (OperandMovesPC(src) || OperandMovesPC(dst))
+			l.kind = LINK_DYN;
+		return;
+	}
+	uint8_t reg = (op >> 6) & 7;
+	switch (op >> 9) {
+	case 0070: case 0071: case 0072: case 0073: case 0074: /* EIS */
+		l.next += sizeof(word_t) * OperandWords(op & 077);
+		if (reg >= Emu::REG_SP || OperandMovesPC(op & 077))
+			l.kind = LINK_DYN;
+		return;
+	case 0077: /* sob */
+		l.kind = reg == Emu::REG_PC ? LINK_DYN : LINK_BRANCH;
+		l.target = l.next - sizeof(word_t) * (op & 077);
+		return;
+	case 0004: /* jsr */
+		l.next += sizeof(word_t) * OperandWords(op & 077);
+		l.kind = LINK_CALL;
+		return;
+	}
+	if (top == 017 || top == 007) {
+		l.kind = LINK_DYN;
+		return;
+	}
+
+	uint8_t hi = op >> 8;
+	if ((hi >= 01 && hi <= 07) || (hi >= 0200 && hi <= 0207)) {
+		l.kind = hi == 01 ? LINK_JUMP : LINK_BRANCH;
+		l.target = l.next + sizeof(word_t) * (s_word_t) (int8_t) (op & 0xff);
+		return;
+	}
+
+	word_t dst = op & 077;
+	switch (op >> 6) {
+	case 00050: case 00051: case 00052: case 00053: case 00054: case 00055:
+	case 00056: case 00057: case 00060: case 00061: case 00062: case 00063:
+	case 01050: case 01051: case 01052: case 01053: case 01054: case 01055:
+	case 01056: case 01057: case 01060: case 01061: case 01062: case 01063:
+	case 00067: case 00003: case 00065: case 00066: case 01065: case 01066:
+		l.next += sizeof(word_t) * OperandWords(dst);
+		if (OperandMovesPC(dst))
+			l.kind = LINK_DYN;
+		return;
+	case 00001: { /* jmp */
+		word_t arg;
+		l.next += sizeof(word_t) * OperandWords(dst);
+		l.kind = LINK_DYN;
+		if (dst != 037 && dst != 067)
+			return;
+		emu.Load(pc + sizeof(word_t), &arg);
+		if (emu.trapPending) { /* handler will trap again */
+			emu.trapPending = false;
+			return;
+		}
+		l.target = dst == 037 ? arg : l.next + arg;
+		l.kind = LINK_JUMP;
+		return;
+	}
+	}
+	if ((op >> 3) == 000020) {
+		l.kind = LINK_RET;
+		return;
+	}
+	if ((op >> 3) == 000023 || (op & ~037) == 0240)
+		return;
+	l.kind = LINK_DYN;
 }
 
-Emu::TrCache Emu::trcache;
+/* Fused handler for instr and the one after it, l becomes link of the pair */
+static trcache_fn_t TrCacheFuse(Emu &emu, word_t op, TrLink &l)
+{
+	TrLink l2;
+	if (!emu.trcache.fuse || l.kind != LINK_NEXT ||
+			l.next >= Emu::IO_PAGE_BASE || emu.HleAt(l.next))
+		return NULL;
+	/* plain core below I/O page, Load() could trap and leave it unset */
+	word_t next = *reinterpret_cast<word_t*>(&emu.coreMem.mem[l.next]);
+	trcache_fn_t fn = Emu::GetTrCacheFused(op, next);
+	if (!fn)
+		return NULL;
+	TrCacheClassify(emu, l.next, next, l2);
+	if (l2.kind == LINK_BRANCH && (!Emu::IsPtrAligned<word_t>(l2.target) ||
+				emu.cov.mode == Coverage::COV_EDGE))
+		return NULL;
+	if (l2.kind != LINK_NEXT && l2.kind != LINK_BRANCH)
+		return NULL;
+	l = l2;
+	return fn;
+}
+
+/* Loop starting at pos as a whole, l links its computed successor */
+static trcache_fn_t TrCacheIdiom(Emu &emu, size_t pos, TrLink &l)
+{
+	word_t pc = pos * sizeof(word_t), words;
+	if (!emu.trcache.fuse || (size_t) pc + 4 * sizeof(word_t) > emu.coreMem.sz ||
+			emu.HleIn(pc, pc + 4 * sizeof(word_t)) ||
+			emu.cov.mode == Coverage::COV_EDGE)
+		return NULL;
+	word_t const *code = reinterpret_cast<word_t*>(&emu.coreMem.mem[pc]);
+	/* cmp loop leaves by bne out before its tail ran, block coverage
+	 * marks the whole idiom, so it needs each instr's own entry */
+	if (emu.cov.mode && (code[0] & 070000) == 020000)
+		return NULL;
+	trcache_fn_t fn = Emu::GetTrCacheIdiom(code, words);
+	if (!fn)
+		return NULL;
+	l.kind = LINK_DYN;
+	l.next = pc + words * sizeof(word_t);
+	l.target = 0;
+	TrCacheCover(emu.trcache, pos, words);
+	return fn;
+}
 
-#ifdef CONF_ENABLE_TRCACHE
+static void TrCacheEmit(Emu::TrCache &trcache, size_t pos, TrLink const &l)
+{
+	auto entry = [&](word_t ptr) { return TrCacheEntry(trcache, ptr); };
+	uint8_t *end = trcache.cache[pos].code + sizeof(trcache_entry);
+	CodeGen g { trcache.cache[pos].code, trcache.wdelta };
+
+	entry(l.next); /* may fall through to it */
+	g.CallMem(&trcache.fn[pos]);
+	switch (l.kind) {
+	case LINK_NEXT:
+		if (PtrToTrCache(l.next) != pos + 1)
+			g.Jmp(entry(l.next));
+		break;
+	case LINK_JUMP:
+		g.Jmp(entry(l.target));
+		break;
+	case LINK_BRANCH:
+		g.B(0x84); g.B(0xc0); /* test %al, %al */
+		g.Jnz(entry(l.target));
+		if (PtrToTrCache(l.next) != pos + 1) /* fused */
+			g.JmpShort(entry(l.next));
+		break;
+	case LINK_CALL:
+		g.B(0x50); /* push %rax, keep callee stack aligned */
+		g.CallMem(trcache.dyn);
+		g.B(0x59); /* pop %rcx */
+		g.JmpShort(entry(l.next));
+		break;
+	case LINK_RET:
+		g.B(0xc3);
+		break;
+	case LINK_DYN:
+		g.JmpMem(trcache.dyn);
+		break;
+	}
+	assert(g.p <= end);
+	g.Nop(end);
+	/* no-op on amd64, stores to the other view are snooped there too */
+	__builtin___clear_cache((char*) trcache.cache[pos].code, (char*) end);
+}
+
+static void TrCacheLink(Emu &emu, size_t pos, word_t op)
+{
+	auto &trcache = emu.trcache;
+	word_t pc = pos * sizeof(word_t);
+	TrLink l;
+	if (emu.HleAt(pc)) {
+		l.kind = LINK_RET;
+		l.next = pc + sizeof(word_t);
+		TrCacheCover(trcache, pos, 1);
+		trcache.fn[pos] = trwrapper_hle;
+		TrCacheEmit(trcache, pos, l);
+		return;
+	}
+	if (trcache_fn_t idiom = TrCacheIdiom(emu, pos, l)) {
+		trcache.fn[pos] = idiom;
+		TrCacheEmit(trcache, pos, l);
+		return;
+	}
+	TrCacheClassify(emu, pc, op, l);
+	if ((l.kind == LINK_JUMP || l.kind == LINK_BRANCH) &&
+			!Emu::IsPtrAligned<word_t>(l.target))
+		l.kind = LINK_DYN;
+
+	trcache_fn_t fused = TrCacheFuse(emu, op, l);
+	TrCacheCover(trcache, pos, (word_t) (l.next - pc) / sizeof(word_t));
+	if (fused) {
+		trcache.fn[pos] = fused;
+		TrCacheEmit(trcache, pos, l);
+		return;
+	}
+	switch (l.kind) {
+	case LINK_CALL:
+		trcache.fn[pos] = trwrapper_call_jsr;
+		break;
+	case LINK_RET:
+		trcache.fn[pos] = trwrapper_ret_rts;
+		break;
+	case LINK_DYN:
+		trcache.fn[pos] = Emu::GetTrCacheExecutorDyn(op);
+		break;
+	default:
+		trcache.fn[pos] = Emu::GetTrCacheExecutor(op);
+		break;
+	}
+	TrCacheEmit(trcache, pos, l);
+}
+
+/* Make entry run its translation, hook does it once entry is hot */
+static void TrCacheTranslate(Emu &emu, size_t pos, word_t op)
+{
+	auto &trcache = emu.trcache;
+	word_t pc = pos * sizeof(word_t);
+	if (emu.engine == Emu::ENGINE_INLINE) {
+		TrCacheLink(emu, pos, op);
+		return;
+	}
+	/* step engine retires one instr per entry, can't fuse */
+	trcache_fn_t fn = NULL;
+	if (emu.engine == Emu::ENGINE_TRLOOP && !emu.HleAt(pc)) {
+		TrLink l;
+		fn = TrCacheIdiom(emu, pos, l);
+		if (!fn) {
+			TrCacheClassify(emu, pc, op, l);
+			if ((fn = TrCacheFuse(emu, op, l)))
+				TrCacheCover(trcache, pos,
+					(word_t) (l.next - pc) / sizeof(word_t));
+		}
+	}
+	if (!fn) {
+		TrCacheCover(trcache, pos, 1);
+		fn = emu.HleAt(pc) ? trwrapper_hle : Emu::GetTrCacheExecutor(op);
+	}
+	trcache.fn[pos] = fn;
+}
+
+/* Instrs translation at pos runs in one go, as if each had its own entry */
+static void TrCacheCovMark(Emu &emu, size_t pos)
+{
+	word_t pc = pos * sizeof(word_t), end = pc + emu.trcache.span[pos] *
+		sizeof(word_t), op;
+	TrLink l;
+	for (l.next = pc; l.next < end; pc = l.next) {
+		emu.cov.Mark(PtrToTrCache(pc));
+		emu.Load(pc, &op);
+		TrCacheClassify(emu, pc, op, l);
+	}
+}
+
+/*
+ * Entry starts cold: every run is interpreted and counted, translation is
+ * spent only on entries hit hotThreshold times. Code that runs once (startup)
+ * is never translated.
+ */
 static void TrCacheHook() {
-	auto &emu = *Emu::trcache.emu;
+	auto &emu = *Emu::cur;
+	auto &trcache = emu.trcache;
 	auto &pc = emu.genReg[Emu::REG_PC];
-	word_t op;
-	Emu::trcache.emu-> Load(pc, &op);
 	size_t pos = PtrToTrCache(pc);
+	word_t op, at = pc;
+	bool edge = emu.cov.mode == Coverage::COV_EDGE &&
+		!emu.cov.EdgesDone(pos) && pc < emu.coreMem.sz &&
+		CovIsBranch(*(reinterpret_cast<word_t*>(&emu.coreMem.mem[pc])));
+
+	if (emu.cov.mode && !(at & 1))
+		emu.cov.Mark(pos);
+	/*
+	 * hle has nothing to interpret, branch is until it went both ways,
+	 * odd pc shares the entry of even one and must trap every time
+	 */
+	if ((trcache.hits[pos] < trcache.hotThreshold && !emu.HleAt(pc)) ||
+			edge || (at & 1)) {
+		trcache.hits[pos]++;
+		emu.FetchOpcode(op);
+		if (!emu.trapPending)
+			emu.ExecuteInstr(op);
+		if (emu.trapPending) {
+			trcache.trapping_opcode = op;
+			longjmp(trcache.restore_buf, 1);
+		}
+		if (edge)
+			emu.cov.MarkEdge(pos, pc != at + sizeof(word_t));
+		if (!--trcache.budget)
+			longjmp(trcache.restore_buf, 1);
+		if (emu.engine == Emu::ENGINE_INLINE)
+			frame_retaddr_set(TrCacheEntry(trcache, pc));
+		return;
+	}
+
+	emu.Load(pc, &op);
 	//std::cout << "hook: " << pos << "\n";
+	TrCacheTranslate(emu, pos, op);
+	if (emu.cov.mode && !(at & 1)) /* rest of fused pair or idiom loop */
+		TrCacheCovMark(emu, pos);
+	if (emu.engine == Emu::ENGINE_INLINE)
+		frame_retaddr_shift(-trcache_entry::CALL_LEN);
+	else
+		trcache.fn[pos]();
+}
 
-	Emu::trcache.cache[pos].set(Emu::GetTrCacheExecutor(op));
-#ifdef CONF_ENABLE_TRCACHE_RUN_INLINE
-	frame_retaddr_shift(-sizeof(trcache_entry));
-#else
-	Emu::trcache.cache[pos].exec();
-#endif
+void TrCacheFill(Emu::TrCache &trcache, size_t chunk) {
+	size_t beg = chunk * Emu::TrCache::CHUNK;
+	size_t end = beg + Emu::TrCache::CHUNK;
+	for (size_t i = beg; i < end; ++i) {
+		CodeGen g { trcache.cache[i].code, trcache.wdelta };
+		trcache.fn[i] = &TrCacheHook;
+		g.CallMem(&trcache.fn[i]);
+		g.Nop(trcache.cache[i].code + sizeof(trcache_entry));
+	}
+	__builtin___clear_cache((char*) &trcache.cache[beg],
+			(char*) &trcache.cache[end]);
+	trcache.filled[chunk] = true;
 }
-#else
-static void TrCacheHook() {
-	// dummy
+
+void Emu::TrCacheAcquire()
+{
+	Emu::cur = this;
 }
-#endif
 
-static void FillHooks(Emu::TrCache &trcache) {
-	for (size_t i = 0; i < Emu::TrCache::sz; ++i)
-		trcache.cache[i].set(&TrCacheHook);
+/*
+ * Ahead of time, as if entry was hot already. Threaded engine decodes on
+ * first run anyway, dbg has nothing to translate.
+ */
+bool Emu::TrCacheWarm(word_t ptr)
+{
+	auto &tc = trcache;
+	size_t pos = PtrToTrCache(ptr);
+	word_t op;
+	if (engine == ENGINE_DBGSTEP || engine == ENGINE_THREADED)
+		return false;
+	if (!IsPtrAligned<word_t>(ptr) || ptr >= coreMem.sz - 1 || tc.span[pos])
+		return false;
+	TrCacheEntry(tc, ptr); /* code must not be refilled over */
+	op = *(reinterpret_cast<word_t*>(&coreMem.mem[ptr]));
+	TrCacheTranslate(*this, pos, op);
+	return true;
 }
 
-void Emu::TrCacheAcquire()
+void Emu::TrCacheFlush()
 {
-	Emu::trcache.emu = this;
+	trcache.Zero();
 }
 
+/*
+ * Entry falls back to the hook and cold state, its code stays in place and
+ * is rewritten only when the hook promotes it again: the instr running now
+ * still returns through the old link, which matches what it executed.
+ */
+void Emu::TrCacheInvalidate(word_t ptr, size_t len)
+{
+	auto &tc = trcache;
+	size_t beg = PtrToTrCache(ptr);
+	size_t end = std::min(PtrToTrCache(ptr + len + 1), TrCache::sz);
+	size_t pos = beg >= TrCache::MAX_SPAN ? beg - TrCache::MAX_SPAN + 1 : 0;
+	bool dropped = false;
+
+	for (; pos < end; ++pos) {
+		if (!tc.span[pos] || pos + tc.span[pos] <= beg)
+			continue;
+		for (size_t i = pos; i < pos + tc.span[pos]; ++i)
+			tc.cover[i]--;
+		tc.span[pos] = 0;
+		tc.hits[pos] = 0;
+		tc.fn[pos] = &TrCacheHook;
+		tc.thr[pos].op = NULL;
+		dropped = true;
+	}
+	if (!dropped)
+		return;
+	/*
+	 * Host return addresses of jsr entries may point to dropped code, and
+	 * rts past the reset shadow stack would never pop their frames: stop
+	 * after this instr and reenter on a clean host stack, like TrRetLink.
+	 */
+	if (engine == ENGINE_INLINE && tc.budget && !tc.relink &&
+			(tc.shadowTop || tc.shadowLost)) {
+		tc.relink = true;
+		tc.relinkCut = tc.budget - 1; /* this one retires */
+		tc.budget = 1;
+	}
+	tc.shadowTop = tc.shadowLost = 0;
+}
+
+/*
+ * Threaded entries depend on code words only, so decoded chunks are kept
+ * in a pool by contents and shared read-only by all Emus of the process.
+ * Pool page is mapped private over Emu's own: the first write to it, by
+ * invalidation on code write, gets Emu a copy from the kernel.
+ * Labels in entries are the same for every Emu, ThreadedRun is one.
+ * Slot counts Emus that mapped it, until they flush or go away, copy on
+ * write or not: a chunk every user wrote to stays for the next one. The
+ * last one out punches the page out of the memfd and the slot is reused,
+ * so the pool holds what live Emus run, not all a process ever ran.
+ */
+static struct ThrPool {
+	struct Chunk {
+		size_t refs; /* 0: free slot */
+		uint64_t hash;
+		word_t code[Emu::TrCache::CHUNK];
+	};
+	std::mutex lock;
+	int fd = -2; /* -1: no pool, entries stay private */
+	std::vector<Chunk> chunks; /* slot i at offset i * THR_PAGE */
+	std::vector<uint32_t> freeSlots;
+	std::unordered_multimap<uint64_t, uint32_t> index;
+} thrPool;
+
+static size_t const THR_PAGE =
+	Emu::TrCache::CHUNK * sizeof(Emu::TrCache::ThrInsn);
+static_assert(THR_PAGE == 4096, "thr chunk is host page");
+
+static word_t const *ThrCode(Emu &emu, size_t chunk)
+{
+	return reinterpret_cast<word_t const*>(emu.coreMem.mem +
+			chunk * Emu::TrCache::CHUNK * sizeof(word_t));
+}
+
+/* FNV-1a */
+static uint64_t ThrHash(word_t const *code)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < Emu::TrCache::CHUNK; ++i)
+		h = (h ^ code[i]) * 0x100000001b3;
+	return h;
+}
+
+/*
+ * Decoded chunk depends on all its words, data too: the first store to a
+ * data word next to code drops its entry, the first in chunk copies the
+ * host page. Later stores to the word find cover clear. Measured on a
+ * guest clearing 200 data words in each of 100 code chunks: 5us per page
+ * and 20ns per word, once per run, next to 9us per chunk running it.
+ */
+static void ThrCover(Emu::TrCache &tc, size_t chunk)
+{
+	for (size_t i = 0; i < Emu::TrCache::CHUNK; ++i) {
+		size_t pos = chunk * Emu::TrCache::CHUNK + i;
+		if (!tc.span[pos])
+			TrCacheCover(tc, pos, 1);
+	}
+}
+
+static bool ThrMap(Emu::TrCache &tc, size_t chunk, uint32_t slot)
+{
+	void *at = &tc.thr[chunk * Emu::TrCache::CHUNK];
+	if (mmap(at, THR_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+				thrPool.fd, (off_t) slot * THR_PAGE) == MAP_FAILED)
+		return false;
+	thrPool.chunks[slot].refs++;
+	tc.thrSlot[chunk] = slot + 1;
+	return true;
+}
+
+/* pool lock held */
+static void ThrUnref(uint32_t slot)
+{
+	auto &pool = thrPool;
+	auto &c = pool.chunks[slot];
+	if (--c.refs)
+		return;
+	auto range = pool.index.equal_range(c.hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == slot) {
+			pool.index.erase(it);
+			break;
+		}
+	}
+	fallocate(pool.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t) slot * THR_PAGE, THR_PAGE);
+	pool.freeSlots.push_back(slot);
+}
+
+/* Emu lets go of its chunks: flush or destruction */
+static void ThrShareDropAll(Emu::TrCache &tc)
+{
+	size_t const n = Emu::TrCache::sz / Emu::TrCache::CHUNK;
+	if (std::find_if(tc.thrSlot, tc.thrSlot + n,
+				[](uint32_t s) { return s; }) == tc.thrSlot + n)
+		return;
+	std::lock_guard<std::mutex> guard(thrPool.lock);
+	for (size_t i = 0; i < n; ++i) {
+		if (tc.thrSlot[i])
+			ThrUnref(tc.thrSlot[i] - 1);
+		tc.thrSlot[i] = 0;
+	}
+}
+
+bool ThrShareAttach(Emu &emu, size_t chunk)
+{
+	auto &pool = thrPool;
+	word_t const *code = ThrCode(emu, chunk);
+	std::lock_guard<std::mutex> guard(pool.lock);
+	if (pool.fd < 0)
+		return false;
+	auto range = pool.index.equal_range(ThrHash(code));
+	for (auto it = range.first; it != range.second; ++it) {
+		auto &c = pool.chunks[it->second];
+		if (memcmp(c.code, code, sizeof(c.code)))
+			continue;
+		if (!ThrMap(emu.trcache, chunk, it->second))
+			return false;
+		ThrCover(emu.trcache, chunk);
+		return true;
+	}
+	return false;
+}
+
+void ThrSharePublish(Emu &emu, size_t chunk)
+{
+	auto &pool = thrPool;
+	auto &tc = emu.trcache;
+	word_t const *code = ThrCode(emu, chunk);
+	ThrCover(tc, chunk);
+
+	std::lock_guard<std::mutex> guard(pool.lock);
+	if (pool.fd == -2)
+		pool.fd = memfd_create("trcache-thr", MFD_CLOEXEC);
+	if (pool.fd < 0)
+		return;
+	uint32_t slot = pool.chunks.size();
+	if (!pool.freeSlots.empty())
+		slot = pool.freeSlots.back();
+	else if (ftruncate(pool.fd, (off_t) (slot + 1) * THR_PAGE) < 0)
+		return;
+	if (pwrite(pool.fd, &tc.thr[chunk * Emu::TrCache::CHUNK], THR_PAGE,
+				(off_t) slot * THR_PAGE) != (ssize_t) THR_PAGE)
+		return;
+	if (slot == pool.chunks.size())
+		pool.chunks.emplace_back();
+	else
+		pool.freeSlots.pop_back();
+	auto &c = pool.chunks[slot];
+	c.refs = 0;
+	c.hash = ThrHash(code);
+	memcpy(c.code, code, sizeof(c.code));
+	pool.index.emplace(c.hash, slot);
+	if (!ThrMap(tc, chunk, slot)) { /* publisher shares it too */
+		c.refs = 1; /* nobody has it yet, give slot back */
+		ThrUnref(slot);
+	}
+}
+
+/*
+ * One mapping: rel32 operands of entries must reach fn and dyn slots.
+ * Plain anonymous memory until EnableExec(). Nothing is filled here,
+ * construction costs two mmaps.
+ */
 Emu::TrCache::TrCache() {
-	cache = (trcache_entry*) xexec_alloc(sizeof(trcache_entry) * Emu::TrCache::sz);
-	FillHooks(*this);
+	size_t slots = 64 + sizeof(trcache_fn_t) * sz;
+	memsz = slots + sizeof(trcache_entry) * sz;
+	metasz = RoundUp((sizeof(ThrInsn) + sizeof(uint16_t) + 2) * sz, 4096);
+	byte_t *mem = LazyMap(memsz);
+	try {
+		meta = LazyMap(metasz);
+	} catch (std::bad_alloc const &) {
+		munmap(mem, memsz);
+		throw;
+	}
+	dyn = (void**) mem;
+	fn = (trcache_fn_t*) (mem + 64);
+	cache = (trcache_entry*) (mem + slots);
+
+	thr = (ThrInsn*) meta;
+	hits = (uint16_t*) (thr + sz);
+	span = (uint8_t*) (hits + sz);
+	cover = span + sz;
+}
+
+/*
+ * Move slots and entries to memfd views. Contents are not carried over:
+ * cache is cold when constructed and SetEngine() flushes it on a switch.
+ */
+int Emu::TrCache::EnableExec() {
+	if (exec)
+		return 0;
+	size_t slots = (byte_t*) cache - (byte_t*) dyn;
+	byte_t *mem = NULL;
+	size_t len = 0;
+	int rc = MemfdMap(memsz, &mem, &xmem, &len);
+	if (rc < 0)
+		return rc;
+	munmap(dyn, memsz);
+	memsz = len;
+	dyn = (void**) mem;
+	fn = (trcache_fn_t*) (mem + 64);
+	wdelta = mem - xmem;
+	cache = (trcache_entry*) (xmem + slots);
+	exec = true;
+	return 0;
+}
+
+/* Back to cold state, pages are released rather than written */
+void Emu::TrCache::Zero() {
+	if (madvise(dyn, memsz, exec ? MADV_REMOVE : MADV_DONTNEED) < 0)
+		memset(dyn, 0, memsz);
+	ThrShareDropAll(*this);
+	LazyMap(metasz, meta); /* unmaps shared thr chunks too */
+	std::fill_n(filled, sz / CHUNK, false);
+	std::fill_n(thrChunk, sz / CHUNK, false);
+	shadowTop = shadowLost = 0;
 }
 
 Emu::TrCache::~TrCache() {
-	xexec_free(cache);
+	ThrShareDropAll(*this);
+	if (xmem && munmap(xmem, memsz) < 0)
+		abort();
+	if (munmap(dyn, memsz) < 0 || munmap(meta, metasz) < 0)
+		abort();
 }
 
-#ifdef CONF_ENABLE_TRCACHE
-void Emu::TrCacheRun(std::ostream &os)
+void Emu::TrCacheRun(std::ostream &os, uint64_t budget)
 {
-	Emu &emu = *Emu::trcache.emu;
+	Emu &emu = *Emu::cur;
 	auto &emupc = emu.genReg[Emu::REG_PC];
-	auto cache = Emu::trcache.cache;
-	if (setjmp(Emu::trcache.restore_buf))
+	emu.trcache.budget = budget;
+	emu.trcache.relink = false;
+relink:
+	emu.trcache.shadowTop = emu.trcache.shadowLost = 0;
+	if (setjmp(emu.trcache.restore_buf))
 		goto restored;
-#ifdef CONF_ENABLE_TRCACHE_RUN_INLINE
-	void *callptr;
-	callptr = (void*) &cache[PtrToTrCache(emupc)];
-	((void(*)()) callptr)();
-#else
+	if (emu.engine == ENGINE_INLINE) {
+		void *callptr;
+		callptr = (void*) TrCacheEntry(emu.trcache, emupc);
+		/* entries call handlers from one frame deeper, keep their stack
+		 * 16-byte aligned; threaded code never returns, exits by longjmp */
+		asm volatile("sub $8, %%rsp\n\tcall *%0"
+				: : "r"(callptr) : "memory");
+		__builtin_unreachable();
+	}
 	while (1) {
-		Emu::trcache.cache[PtrToTrCache(emupc)].exec();
+		trcache_fn_t fn = emu.trcache.fn[PtrToTrCache(emupc)];
+		(fn ? fn : TrCacheHook)();
 	}
-#endif
 
 	restored:
+	/* give back budget cut by TrCacheInvalidate */
+	emu.trcache.budget += emu.trcache.relinkCut;
+	if (emu.waiting)
+		emu.trcache.waitBudget += emu.trcache.relinkCut;
+	emu.trcache.relinkCut = 0;
 	if (emu.trapPending)
 		goto trapped;
-	assert(0 && "restored with no reason");
+	if (emu.trcache.relink) {
+		emu.trcache.relink = false;
+		if (emu.trcache.budget && !emu.waiting)
+			goto relink;
+	}
+	assert((!emu.trcache.budget || emu.waiting) && "restored with no reason");
 	return;
 trapped:
 	os << "\tTrap raised: ";
@@ -101,16 +820,11 @@ trapped:
 	os << "\n";
 	return;
 }
-#else
-void Emu::TrCacheRun(std::ostream &os) {
-	// dummy
-}
-#endif
 
 
 void Emu::TrCacheStep(std::ostream &os)
 {
-	Emu &emu = *Emu::trcache.emu;
+	Emu &emu = *Emu::cur;
 #ifdef CONF_DUMP_REG
 	emu.DumpReg(os);
 	os << "\n";
@@ -119,18 +833,23 @@ void Emu::TrCacheStep(std::ostream &os)
 #ifdef CONF_DUMP_INSTR
 	word_t opcode_dump;
 	emu.Load(emu.genReg[REG_PC], &opcode_dump);
+	emu.DumpSym(emu.genReg[REG_PC], os);
+	os << "\t";
 	emu.DumpInstr(opcode_dump, os);
 	os << "\n";
 #endif
-	if (setjmp(Emu::trcache.restore_buf))
+	emu.trcache.budget = UINT64_MAX;
+	if (setjmp(emu.trcache.restore_buf))
 		goto restored;
-	Emu::trcache.cache[PtrToTrCache(emupc)].exec();
+	trcache_fn_t fn;
+	fn = emu.trcache.fn[PtrToTrCache(emupc)];
+	(fn ? fn : TrCacheHook)();
 	return;
 
 restored:
 	if (emu.trapPending)
 		goto trapped;
-	assert(0 && "restored with no reason");
+	assert(emu.waiting && "restored with no reason");
 	return;
 trapped:
 	os << "\tTrap raised: ";
@@ -1,39 +1,85 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
 #include "emu.h"
 
 #define log_trcache() do {					\
-	auto emupc = Emu::trcache.emu->genReg[Emu::REG_PC];	\
+	auto emupc = Emu::cur->genReg[Emu::REG_PC];		\
 	void *retaddr = frame_retaddr;				\
 	std::cout << emupc << " " << (((size_t) retaddr) / sizeof(trcache_entry)) - 1 << std::endl;	\
 } while (0)
 
 #define frame_retaddr (*((void**) __builtin_frame_address(0) + 1))
 
+/* volatile: store to caller's frame is dead for the optimizer */
 #define frame_retaddr_shift(offs) do {			\
-	size_t *rap = (size_t*) &frame_retaddr;		\
+	size_t volatile *rap = (size_t*) &frame_retaddr;	\
 	*rap += (offs);					\
 } while(0)
 
+#define frame_retaddr_set(ptr) do {			\
+	void *volatile *rap = &frame_retaddr;		\
+	*rap = (void*) (ptr);				\
+} while(0)
+
+/*
+ * Entry per guest word. Inline mode executes it as amd64 code: every entry
+ * calls its handler through TrCache::fn, then links to the successor so
+ * the host predicts the transfer instead of mispredicting shifted rets:
+ *   next:   call *fn; nop			fall into next entry
+ *   jump:   call *fn; jmp succ		operand words, br, static jmp
+ *   branch: call *fn; test al,al; jnz target	handler returns taken
+ *   call:   call *fn; push; call *dyn; pop; jmp succ	jsr, rts returns here
+ *   ret:    call *fn; ret			rts matching shadow stack
+ *   dyn:    call *fn; jmp *dyn		pc computed at runtime
+ * Loop mode only uses fn slots.
+ */
 struct __attribute__((packed)) trcache_entry {
-	uint64_t _mov_rax : 16;
-	uint64_t _mov_imm : 64;
-	uint64_t _call_rax : 16;
-
-	inline void set(trcache_fn_t fn) {
-		_mov_rax = 0xb848;
-		_mov_imm = (uint64_t) fn;
-		_call_rax = 0xd0ff;
-	}
-
-	inline void exec() {
-		((trcache_fn_t) _mov_imm)();
-	}
+	static constexpr size_t CALL_LEN = 6; /* call *fn(%rip) */
+	uint8_t code[16];
 };
+static_assert(sizeof(trcache_entry) == 16, "entry layout");
+static_assert(Coverage::WORDS == Emu::TrCache::sz, "bit per entry");
+static_assert(Emu::TrCache::CHUNK * sizeof(trcache_entry) == 4096,
+		"chunk is host page of entries");
+
+/* isa.cpp: handlers of call/ret entries */
+void trwrapper_call_jsr();
+void trwrapper_ret_rts();
+void trwrapper_hle();
 
 static inline size_t PtrToTrCache(word_t ptr)
 {
 	return ptr / sizeof(word_t);
 }
 
+/* trcache.cpp: hook entries of chunk, before host may run any of them */
+void TrCacheFill(Emu::TrCache &trcache, size_t chunk);
+
+/* Host address of entry for ptr, inline engine may jump there */
+static inline trcache_entry *TrCacheEntry(Emu::TrCache &trcache, word_t ptr)
+{
+	size_t pos = PtrToTrCache(ptr);
+	if (!trcache.filled[pos / Emu::TrCache::CHUNK])
+		TrCacheFill(trcache, pos / Emu::TrCache::CHUNK);
+	return &trcache.cache[pos];
+}
+
+/*
+ * trcache.cpp: threaded engine chunks shared by Emus of the process.
+ * Attach maps a decoded chunk with same code words, false if none.
+ * Publish offers a chunk Emu has decoded itself.
+ */
+bool ThrShareAttach(Emu &emu, size_t chunk);
+void ThrSharePublish(Emu &emu, size_t chunk);
+
+/* Translation of entry at pos was made from n code words starting there */
+static inline void TrCacheCover(Emu::TrCache &trcache, size_t pos, size_t n)
+{
+	n = std::min(std::max<size_t>(n, 1), Emu::TrCache::MAX_SPAN);
+	n = std::min(n, Emu::TrCache::sz - pos);
+	trcache.span[pos] = n;
+	for (size_t i = pos; i < pos + n; ++i)
+		trcache.cover[i]++;
+}
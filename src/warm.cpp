@@ -0,0 +1,133 @@
+#include "warm.h"
+#include "trcache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* FNV-1a */
+static uint64_t Hash(byte_t const *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ p[i]) * 0x100000001b3;
+	return h;
+}
+
+static size_t const CHUNK_BYTES = Emu::TrCache::CHUNK * sizeof(word_t);
+static size_t const NCHUNK = Emu::CoreMemory::sz / CHUNK_BYTES;
+
+int WarmCache::Open(Emu &emu, char const *dir)
+{
+	byte_t const *core = emu.coreMem.mem;
+	key = Hash(core, Emu::CoreMemory::sz);
+	chunkHash.resize(NCHUNK);
+	for (size_t c = 0; c < NCHUNK; ++c)
+		chunkHash[c] = Hash(core + c * CHUNK_BYTES, CHUNK_BYTES);
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.trc", (unsigned long long) key);
+	path = std::string(dir) + name;
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+	if ((size_t) st.st_size < sizeof(Hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return -errno;
+
+	int rc = 0;
+	Hdr const *hdr = (Hdr const*) ptr;
+	Rec const *rec = (Rec const*) (hdr + 1);
+	if (hdr->magic != MAGIC || hdr->key != key || (size_t) st.st_size !=
+			sizeof(Hdr) + hdr->nrec * sizeof(Rec)) {
+		rc = -EINVAL;
+		goto out;
+	}
+	/* chunk may be stale or wrong, its own hash decides */
+	for (uint32_t i = 0; i < hdr->nrec; ++i, ++rec) {
+		if (rec->chunk >= NCHUNK || chunkHash[rec->chunk] != rec->hash)
+			continue;
+		for (size_t j = 0; j < CHUNK; ++j) {
+			if (!(rec->hot[j / 8] & (1 << (j % 8))))
+				continue;
+			word_t ptr = (rec->chunk * CHUNK + j) * sizeof(word_t);
+			nWarmed += emu.TrCacheWarm(ptr);
+		}
+	}
+out:
+	munmap(ptr, st.st_size);
+	return rc;
+}
+
+int WarmCache::Save(Emu &emu)
+{
+	auto &tc = emu.trcache;
+	std::vector<Rec> recs;
+	if (path.empty())
+		return -EINVAL;
+	for (size_t c = 0; c < NCHUNK; ++c) {
+		Rec rec = { };
+		for (size_t j = 0; j < CHUNK; ++j) {
+			if (!tc.span[c * CHUNK + j])
+				continue;
+			rec.hot[j / 8] |= 1 << (j % 8);
+			rec.nhot++;
+		}
+		if (!rec.nhot)
+			continue;
+		/* as loaded: next run starts from that, code may be patched */
+		rec.chunk = c;
+		rec.hash = chunkHash[c];
+		recs.push_back(rec);
+	}
+
+	/* other runs may read it meanwhile: write aside, then rename */
+	std::string tmp = path + "." + std::to_string(getpid());
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	Hdr hdr = { MAGIC, (uint32_t) recs.size(), key };
+	int rc = 0;
+	struct {
+		void const *p;
+		size_t len;
+	} const parts[] = {
+		{ &hdr, sizeof(hdr) },
+		{ recs.data(), recs.size() * sizeof(Rec) },
+	};
+	for (auto &part : parts) {
+		size_t off = 0;
+		while (!rc && off < part.len) {
+			ssize_t n = write(fd, (byte_t const*) part.p + off,
+					part.len - off);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				rc = -errno;
+				continue;
+			}
+			off += n;
+		}
+	}
+	if (close(fd) < 0 && !rc)
+		rc = -errno;
+	if (!rc && rename(tmp.c_str(), path.c_str()) < 0)
+		rc = -errno;
+	if (rc)
+		unlink(tmp.c_str());
+	return rc;
+}
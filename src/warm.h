@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "emu.h"
+
+/*
+ * Translation profile kept on disk between runs of the same image.
+ * File is named by hash of core right after image load, it keeps per
+ * chunk of code words a hash of its loaded contents and bitmap of entries
+ * that got translated. Host code itself is not saved: handler addresses differ
+ * per process. A chunk whose contents still match is translated ahead
+ * of time, so warm start skips interpretation of hot entries.
+ */
+struct WarmCache {
+	uint64_t nWarmed = 0;	/* entries translated ahead by Open */
+
+	/* after image is loaded, no file yet is not an error */
+	int Open(Emu &emu, char const *dir);
+	/* store profile of this run, replaces previous one */
+	int Save(Emu &emu);
+
+private:
+	static constexpr uint32_t MAGIC = 0x54313150; /* "P11T" */
+	static constexpr size_t CHUNK = Emu::TrCache::CHUNK;
+	struct Hdr {
+		uint32_t magic;
+		uint32_t nrec;
+		uint64_t key;
+	};
+	struct Rec {
+		uint64_t hash;
+		uint32_t chunk;
+		uint32_t nhot;
+		uint8_t hot[CHUNK / 8];
+	};
+
+	std::string path;
+	uint64_t key = 0;
+	std::vector<uint64_t> chunkHash; /* as loaded */
+};
@@ -0,0 +1,143 @@
+/ EIS and sob against expected results.  Each table record is the
+/ instruction word, r0 r1 r2 before, r0 r1 r2 after and nzvc after
+/ (n=010 z=04 v=02 c=01); the instruction is patched into run and
+/ executed with all condition codes clear.  Register operands are
+/ fixed: div r2,r0  ashc r2,r0  ashc r2,r1  xor r0,r2.
+/ Ends in wait, halt on the first mismatch with r4 at the record.
+
+.globl _start
+
+.text
+
+_start:
+	mov	$01000, sp
+
+/ sob: counts down to zero, 0 means 65536 passes
+	mov	$3, r1
+	clr	r2
+1:	inc	r2
+	sob	r1, 1b
+	tst	r1
+	bne	fail
+	cmp	$3, r2
+	bne	fail
+	clr	r1
+	clr	r2
+	clr	r3
+1:	inc	r2
+	bne	2f
+	inc	r3
+2:	sob	r1, 1b
+	tst	r2
+	bne	fail
+	cmp	$1, r3
+	bne	fail
+
+/ sob leaves the condition codes alone
+	mov	$2, r1
+	scc
+1:	sob	r1, 1b
+	bpl	fail
+	bne	fail
+	bvc	fail
+	bcc	fail
+
+	mov	$cases, r4
+next:
+	cmp	r4, $end
+	beq	pass
+	mov	(r4)+, instr
+	clr	r5
+	jsr	pc, run
+	bpl	1f
+	bis	$010, r5
+1:	jsr	pc, run
+	bne	1f
+	bis	$04, r5
+1:	jsr	pc, run
+	bvc	1f
+	bis	$02, r5
+1:	jsr	pc, run
+	bcc	1f
+	bis	$01, r5
+1:	cmp	r0, 6(r4)
+	bne	fail
+	cmp	r1, 8(r4)
+	bne	fail
+	cmp	r2, 10(r4)
+	bne	fail
+	cmp	r5, 12(r4)
+	bne	fail
+	add	$14, r4
+	br	next
+
+pass:
+	wait
+fail:
+	halt
+
+run:
+	mov	(r4), r0
+	mov	2(r4), r1
+	mov	4(r4), r2
+	ccc
+instr:
+	.word	0
+	rts	pc
+
+cases:
+/ zero divisor
+	.word	071002, 00, 0144, 00, 00, 0144, 00, 07
+/ zero divisor, zero dividend
+	.word	071002, 00, 00, 00, 00, 00, 00, 07
+/ 0x80000000 / -1
+	.word	071002, 0100000, 00, 0177777, 0100000, 00, 0177777, 02
+/ 0x10000 / 1, quotient overflow
+	.word	071002, 01, 00, 01, 01, 00, 01, 02
+/ -0x10000 / 1, quotient overflow
+	.word	071002, 0177777, 00, 01, 0177777, 00, 01, 02
+/ 65535 / 2 = 32767 r 1, largest quotient
+	.word	071002, 00, 0177777, 02, 077777, 01, 02, 00
+/ 65536 / 2 = 32768, just over
+	.word	071002, 01, 00, 02, 01, 00, 02, 02
+/ -65536 / 2 = -32768, smallest quotient
+	.word	071002, 0177777, 00, 02, 0100000, 00, 02, 010
+/ 100 / 7 = 14 r 2
+	.word	071002, 00, 0144, 07, 016, 02, 07, 00
+/ -100 / 7 = -14 r -2
+	.word	071002, 0177777, 0177634, 07, 0177762, 0177776, 07, 010
+/ 100 / -7 = -14 r 2
+	.word	071002, 00, 0144, 0177771, 0177762, 02, 0177771, 010
+/ 5 / 7 = 0 r 5
+	.word	071002, 00, 05, 07, 00, 05, 07, 04
+/ +31: 1 to sign
+	.word	073002, 00, 01, 037, 0100000, 00, 037, 012
+/ +31: 3, carry out of bit 31
+	.word	073002, 00, 03, 037, 0100000, 00, 037, 013
+/ 32: right 32, negative
+	.word	073002, 0100000, 01, 040, 0177777, 0177777, 040, 011
+/ -32: right 32, positive
+	.word	073002, 040000, 00, 0177740, 00, 00, 0177740, 04
+/ -31: right 31, negative
+	.word	073002, 0100000, 00, 0177741, 0177777, 0177777, 0177741, 010
+/ -1: right 1, carry from bit 0
+	.word	073002, 00, 03, 0177777, 00, 01, 0177777, 01
+/ 0: no shift
+	.word	073002, 011064, 053170, 00, 011064, 053170, 00, 00
+/ count is low 6 bits only: 0101 is +1
+	.word	073002, 00, 01, 0101, 00, 02, 0101, 00
+/ +1: overflow into sign
+	.word	073002, 040000, 00, 01, 0100000, 00, 01, 012
+/ odd reg, -1: rotates low word right
+	.word	073102, 0111111, 0100001, 0177777, 0111111, 0140000, 0177777, 011
+/ odd reg, +1: low word only
+	.word	073102, 0111111, 0100001, 01, 0111111, 02, 01, 03
+/ odd reg, -32
+	.word	073102, 0111111, 0100001, 0177740, 0111111, 0177777, 0177740, 011
+/ odd reg, +16: high word out
+	.word	073102, 0111111, 0100001, 020, 0111111, 00, 020, 013
+/ sign set
+	.word	074002, 0100000, 00, 01, 0100000, 00, 0100001, 010
+/ same value gives zero
+	.word	074002, 011064, 00, 011064, 011064, 00, 00, 04
+end:
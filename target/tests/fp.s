@@ -0,0 +1,151 @@
+/ FP11 rounding and truncation against expected results.  Each table
+/ record is the FPS to load, the instruction word, ac0 and the source
+/ operand before, ac0, the operand and the FPS after; the instruction
+/ is patched into next with ac0 as accumulator and (r1) pointing at
+/ the operand.  FPS 040 (FT) chops, 0100 (FL) makes integers long.
+/ Ends in wait, halt on the first mismatch with r4 at the record.
+
+.globl _start
+
+.text
+
+_start:
+	mov	$01000, sp
+	mov	$cases, r4
+next:
+	cmp	r4, $end
+	beq	pass
+	mov	2(r4), instr
+	mov	8(r4), src
+	mov	10(r4), src+2
+	ldfps	(r4)
+	mov	r4, r1
+	add	$4, r1
+	ldf	(r1), fr0
+	mov	$src, r1
+instr:
+	.word	0
+	stfps	r2
+	mov	$res, r1
+	stf	fr0, (r1)
+	cmp	res, 12(r4)
+	bne	fail
+	cmp	res+2, 14(r4)
+	bne	fail
+	cmp	src, 16(r4)
+	bne	fail
+	cmp	src+2, 18(r4)
+	bne	fail
+	cmp	r2, 20(r4)
+	bne	fail
+	add	$22, r4
+	br	next
+
+pass:
+	wait
+fail:
+	halt
+
+src:
+	.word	0, 0
+res:
+	.word	0, 0
+
+cases:
+/ 1 + 2^-24, half an lsb, round
+	.word	00, 0172011, 040200, 00, 032200, 00
+	.word	040200, 01, 032200, 00, 00
+/ 1 + 2^-24, half an lsb, chop
+	.word	040, 0172011, 040200, 00, 032200, 00
+	.word	040200, 00, 032200, 00, 040
+/ 1 + 3*2^-25, three quarters, round
+	.word	00, 0172011, 040200, 00, 032300, 00
+	.word	040200, 01, 032300, 00, 00
+/ 1 + 3*2^-25, three quarters, chop
+	.word	040, 0172011, 040200, 00, 032300, 00
+	.word	040200, 00, 032300, 00, 040
+/ 1 + 2^-25, a quarter, round
+	.word	00, 0172011, 040200, 00, 032000, 00
+	.word	040200, 00, 032000, 00, 00
+/ 1 + 2^-25, a quarter, chop
+	.word	040, 0172011, 040200, 00, 032000, 00
+	.word	040200, 00, 032000, 00, 040
+/ -1 - 2^-24, half away from zero, round
+	.word	00, 0172011, 0140200, 00, 0132200, 00
+	.word	0140200, 01, 0132200, 00, 010
+/ -1 - 2^-24, half away from zero, chop
+	.word	040, 0172011, 0140200, 00, 0132200, 00
+	.word	0140200, 00, 0132200, 00, 050
+/ 1 - 2^-25, half into the lower binade, round
+	.word	00, 0173011, 040200, 00, 032000, 00
+	.word	040200, 00, 032000, 00, 00
+/ 1 - 2^-25, half into the lower binade, chop
+	.word	040, 0173011, 040200, 00, 032000, 00
+	.word	040177, 0177777, 032000, 00, 040
+/ (1 + 2^-23) * 1.5, round
+	.word	00, 0171011, 040200, 01, 040300, 00
+	.word	040300, 02, 040300, 00, 00
+/ (1 + 2^-23) * 1.5, chop
+	.word	040, 0171011, 040200, 01, 040300, 00
+	.word	040300, 01, 040300, 00, 040
+/ 1 / 3, round
+	.word	00, 0174411, 040200, 00, 040500, 00
+	.word	037652, 0125253, 040500, 00, 00
+/ 1 / 3, chop
+	.word	040, 0174411, 040200, 00, 040500, 00
+	.word	037652, 0125252, 040500, 00, 040
+/ -2 / 3, round
+	.word	00, 0174411, 0140400, 00, 040500, 00
+	.word	0140052, 0125253, 040500, 00, 010
+/ -2 / 3, chop
+	.word	040, 0174411, 0140400, 00, 040500, 00
+	.word	0140052, 0125252, 040500, 00, 050
+/ ldcif long 2^24 + 1, round
+	.word	0100, 0177011, 00, 00, 0400, 01
+	.word	046200, 01, 0400, 01, 0100
+/ ldcif long 2^24 + 3, round
+	.word	0100, 0177011, 00, 00, 0400, 03
+	.word	046200, 02, 0400, 03, 0100
+/ ldcif word -3, round
+	.word	00, 0177011, 00, 00, 0177775, 0125252
+	.word	0140500, 00, 0177775, 0125252, 010
+/ ldcif long 2^24 + 1, chop
+	.word	0140, 0177011, 00, 00, 0400, 01
+	.word	046200, 00, 0400, 01, 0140
+/ ldcif long 2^24 + 3, chop
+	.word	0140, 0177011, 00, 00, 0400, 03
+	.word	046200, 01, 0400, 03, 0140
+/ ldcif word -3, chop
+	.word	040, 0177011, 00, 00, 0177775, 0125252
+	.word	0140500, 00, 0177775, 0125252, 050
+/ stcfi 2.75 to word, round
+	.word	00, 0175411, 040460, 00, 0125252, 0125252
+	.word	040460, 00, 02, 0125252, 00
+/ stcfi -2.75 to word, round
+	.word	00, 0175411, 0140460, 00, 0125252, 0125252
+	.word	0140460, 00, 0177776, 0125252, 010
+/ stcfi 100000.5 to long, round
+	.word	0100, 0175411, 044303, 050100, 0125252, 0125252
+	.word	044303, 050100, 01, 0103240, 0100
+/ stcfi -0.5 to word, round
+	.word	00, 0175411, 0140000, 00, 0125252, 0125252
+	.word	0140000, 00, 00, 0125252, 04
+/ stcfi 40000 to word, out of range, round
+	.word	00, 0175411, 044034, 040000, 0125252, 0125252
+	.word	044034, 040000, 00, 0125252, 05
+/ stcfi 2.75 to word, chop
+	.word	040, 0175411, 040460, 00, 0125252, 0125252
+	.word	040460, 00, 02, 0125252, 040
+/ stcfi -2.75 to word, chop
+	.word	040, 0175411, 0140460, 00, 0125252, 0125252
+	.word	0140460, 00, 0177776, 0125252, 050
+/ stcfi 100000.5 to long, chop
+	.word	0140, 0175411, 044303, 050100, 0125252, 0125252
+	.word	044303, 050100, 01, 0103240, 0140
+/ stcfi -0.5 to word, chop
+	.word	040, 0175411, 0140000, 00, 0125252, 0125252
+	.word	0140000, 00, 00, 0125252, 044
+/ stcfi 40000 to word, out of range, chop
+	.word	040, 0175411, 044034, 040000, 0125252, 0125252
+	.word	044034, 040000, 00, 0125252, 045
+end:
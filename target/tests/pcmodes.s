@@ -0,0 +1,69 @@
+/ Operands in the instruction stream: #imm, @#abs, rel and @rel, read
+/ and written.  Stores through #imm and rel change code that already
+/ ran, its next run must see the new word.
+/ Ends in wait, halt on the first mismatch with r4 at its check.
+
+.globl _start
+
+.text
+
+_start:
+	mov	$01000, sp
+	mov	$1, r4
+	mov	$012345, r0
+	cmp	$012345, r0
+	bne	fail
+	inc	r4
+	movb	$0377, r1
+	cmp	$-1, r1
+	bne	fail
+	inc	r4
+	clr	r2
+	bisb	$0200, r2
+	cmp	$0200, r2
+	bne	fail
+
+	inc	r4
+	mov	@$var, r0
+	cmp	$0707, r0
+	bne	fail
+	inc	r4
+	mov	var, r0
+	cmp	$0707, r0
+	bne	fail
+	inc	r4
+	mov	@pvar, r0
+	cmp	$0707, r0
+	bne	fail
+	inc	r4
+	add	$1, @$var
+	inc	var
+	add	$1, @pvar
+	cmp	$0712, var
+	bne	fail
+
+/ add $n, r1 with n bumped by the inc after it, 0 + 1 + ... + 19, past
+/ the hot threshold so the translated entry sees the writes too
+	inc	r4
+	clr	r1
+	mov	$20, r3
+1:	add	$0, r1
+	inc	1b+2
+	sob	r3, 1b
+	cmp	$190, r1
+	bne	fail
+/ inc of #imm writes its own immediate word
+	inc	r4
+	mov	$20, r3
+2:	inc	$0
+	sob	r3, 2b
+	cmp	$20, 2b+2
+	bne	fail
+	wait
+fail:
+	halt
+
+var:
+	.word	0707
+pvar:
+	.word	var
@@ -0,0 +1,51 @@
+/*
+ * Host side of guest tests: runs a raw image on every engine. Test ends
+ * in wait when passed, in halt when a check failed, r4 points past the
+ * failed case then.
+ */
+#include "pdp11emu.h"
+#include <stdio.h>
+
+#define LOAD_ADDR 01000
+#define MAX_INSTRS 1000000000ull
+
+static char const *engines[] = { "dbg", "step", "loop", "inline", "threaded" };
+
+int main(int argc, char **argv)
+{
+	int e, failed = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "%s <test.bin>\n", argv[0]);
+		return 2;
+	}
+	for (e = PDP11_ENGINE_DBG; e <= PDP11_ENGINE_THREADED; ++e) {
+		pdp11_emu *emu = pdp11_create();
+		uint16_t r4 = 0, pc = 0;
+
+		if (!emu) {
+			fprintf(stderr, "pdp11_create failed\n");
+			return 2;
+		}
+		if (pdp11_set_engine(emu, e) < 0) {
+			pdp11_destroy(emu);
+			continue; /* not supported by host */
+		}
+		if (pdp11_load_image(emu, argv[1], LOAD_ADDR) < 0) {
+			fprintf(stderr, "%s: load failed\n", argv[1]);
+			return 2;
+		}
+		pdp11_run(emu, MAX_INSTRS);
+		if (pdp11_get_state(emu) != PDP11_WAITING) {
+			pdp11_reg_read(emu, PDP11_R4, &r4);
+			pdp11_reg_read(emu, PDP11_PC, &pc);
+			printf("%s: FAIL on %s, pc %06o r4 %06o\n", argv[1],
+					engines[e], pc, r4);
+			failed = 1;
+		}
+		pdp11_destroy(emu);
+	}
+	if (!failed)
+		printf("%s: ok\n", argv[1]);
+	return failed;
+}
@@ -0,0 +1,25 @@
+/ Subroutine patching its own immediate, called in a loop: every call
+/ drops the translation of the one before while host frames of jsr
+/ entries are live, they must not pile up on the host stack.
+/ Ends in wait with r1 = last count, halt on mismatch.
+
+.globl _start
+
+.text
+
+_start:
+	mov	$01000, sp
+	mov	$100, r4
+1:	clr	r2
+2:	jsr	pc, count
+	sob	r2, 2b
+	sob	r4, 1b
+	cmp	$-1, r1
+	bne	3f
+	wait
+3:	halt
+
+count:
+	mov	$0, r1
+	inc	count+2
+	rts	pc